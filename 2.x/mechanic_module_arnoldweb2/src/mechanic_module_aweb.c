@@ -11,7 +11,13 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <mpi.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /**
  * Include Mechanic datatypes and function prototypes
@@ -27,9 +33,9 @@
  * @brief Implements Init()
  */
 int Init(init *i) {
-  i->options = 24;
-  i->banks_per_pool = 2;
-  i->banks_per_task = 3;
+  i->options = 40;
+  i->banks_per_pool = 6;
+  i->banks_per_task = 5;
   i->pools = 25;
 
   return SUCCESS;
@@ -94,7 +100,7 @@ int Setup(setup *s) {
     .shortName='\0',
     .value="0.0",
     .type=LRC_DOUBLE,
-    .description="Minimum perturbation parameter"
+    .description="Minimum perturbation parameter (the perturbation of the first pool)"
   };
   s->options[7] = (LRC_configDefaults) {
     .space="arnold",
@@ -102,7 +108,7 @@ int Setup(setup *s) {
     .shortName='\0',
     .value="1",
     .type=LRC_INT,
-    .description="The driver: 1 - leapfrog, 2 - SABA3"
+    .description="The driver: 1 - SABA2, 2 - SABA3, 3 - SABA4, 4 - SBAB2, 5 - SBAB3, 6 - SBAB4, 7 - Yoshida4"
   };
   s->options[8] = (LRC_configDefaults) {
     .space="arnold",
@@ -118,24 +124,489 @@ int Setup(setup *s) {
     .type=LRC_DOUBLE,
     .description="The maximum perturbation parameter"
   };
-  s->options[10] = (LRC_configDefaults) LRC_OPTIONS_END;
+  s->options[10] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="tilex",
+    .value="1",
+    .type=LRC_INT,
+    .description="The number of map pixels along x integrated by one task"
+  };
+  s->options[11] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="tiley",
+    .value="1",
+    .type=LRC_INT,
+    .description="The number of map pixels along y integrated by one task"
+  };
+  s->options[12] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="converge",
+    .value="0",
+    .type=LRC_INT,
+    .description="Stop the integration once the orbit is classified: 0 - off, 1 - on"
+  };
+  s->options[13] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="conv_tmin",
+    .value="1000.0",
+    .type=LRC_DOUBLE,
+    .description="The minimum integration time before the orbit is classified"
+  };
+  s->options[14] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="conv_regular",
+    .value="0.05",
+    .type=LRC_DOUBLE,
+    .description="Regular orbit: |<Y>-2| below this value over the second half of the run"
+  };
+  s->options[15] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="conv_chaotic",
+    .value="5.0",
+    .type=LRC_DOUBLE,
+    .description="Chaotic orbit: <Y> above this value"
+  };
+  s->options[16] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="refine",
+    .value="0",
+    .type=LRC_INT,
+    .description="The coarse grid spacing (pixels) of the adaptive tile refinement, 0 - off"
+  };
+  s->options[17] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="refine_tol",
+    .value="0.5",
+    .type=LRC_DOUBLE,
+    .description="Refine the cells whose corner MEGNO values differ by more than this"
+  };
+  s->options[18] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="eps_skip",
+    .value="0.0",
+    .type=LRC_DOUBLE,
+    .description="Do not integrate pixels with the previous pool MEGNO above this value, 0 - off"
+  };
+  s->options[19] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="threads",
+    .value="0",
+    .type=LRC_INT,
+    .description="The number of OpenMP threads per worker (hybrid build), 0 - OpenMP default"
+  };
+  s->options[20] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="corrector",
+    .value="0",
+    .type=LRC_INT,
+    .description="Apply the corrector of Laskar & Robutel (SABA/SBAB drivers), 0 - off"
+  };
+  s->options[21] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="rotate",
+    .value="0",
+    .type=LRC_INT,
+    .description="Advance the sin/cos of the angles by rotations in the drifts, 0 - off"
+  };
+  s->options[22] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="megno_stride",
+    .value="1",
+    .type=LRC_INT,
+    .description="Sample the MEGNO every megno_stride steps"
+  };
+  s->options[23] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="checkout",
+    .value="1000",
+    .type=LRC_INT,
+    .description="Check the energy every checkout steps"
+  };
+  s->options[24] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="instrument",
+    .value="0",
+    .type=LRC_INT,
+    .description="Store the cost of each pixel (ticks, steps, kicks, task time), 0 - off"
+  };
+  s->options[25] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="schedule",
+    .value="0",
+    .type=LRC_INT,
+    .description="Hand out the tasks by their predicted cost, the largest first: 0 - off, 1 - on"
+  };
+  s->options[26] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="slice",
+    .value="0.0",
+    .type=LRC_DOUBLE,
+    .description="Integrate in slices of this time, restarting the task until done, 0 - off"
+  };
+  s->options[27] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="series",
+    .value="0",
+    .type=LRC_INT,
+    .description="Store <Y>(t) and the energy error at this many log-spaced times, 0 - off"
+  };
+  s->options[28] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="series_tmin",
+    .value="10.0",
+    .type=LRC_DOUBLE,
+    .description="The first time of the series, the last one is tend"
+  };
+  s->options[29] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="compact",
+    .value="0",
+    .type=LRC_INT,
+    .description="Store the result without x, y as float32 pairs (not readable as doubles): 0/1"
+  };
+  s->options[30] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="local_ic",
+    .value="0",
+    .type=LRC_INT,
+    .description="The workers compute the initial conditions, none are sent: 0 - off, 1 - on"
+  };
+  s->options[31] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="angle1",
+    .value="0.131",
+    .type=LRC_DOUBLE,
+    .description="The initial first angle of the orbits, the same for all pixels"
+  };
+  s->options[32] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="angle2",
+    .value="0.132",
+    .type=LRC_DOUBLE,
+    .description="The initial second angle of the orbits, the same for all pixels"
+  };
+  s->options[33] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="angle3",
+    .value="0.212",
+    .type=LRC_DOUBLE,
+    .description="The initial third angle of the orbits, the same for all pixels"
+  };
+  s->options[34] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="action3",
+    .value="0.01",
+    .type=LRC_DOUBLE,
+    .description="The initial third action I3 of the orbits, the same for all pixels"
+  };
+  s->options[35] = (LRC_configDefaults) {
+    .space="arnold",
+    .name="samples",
+    .value="1",
+    .type=LRC_INT,
+    .description="The lattice of initial angles per pixel, reduced to the mean and max MEGNO"
+  };
+  s->options[36] = (LRC_configDefaults) LRC_OPTIONS_END;
 
   return SUCCESS;
 }
 
+/**
+ * The maximum number of points of the time series
+ */
+#define SERIES_MAX 256
+
+/**
+ * The module parameters, parsed once per pool
+ */
+typedef struct {
+  int pid; /**< The pool of the parameters, -1 before the first parsing */
+  double step; /**< The time step, scaled by (sqrt(5)-1)/2 */
+  double tend;
+  double eps; /**< The perturbation parameter of the pool, eps + pid*eps_interval */
+  double eps_interval;
+  double epsmax;
+  double eps_skip;
+  double xmin, xmax, ymin, ymax;
+  int driver;
+  int corrector;
+  int rotate;
+  int megno_stride;
+  int checkout;
+  int instrument;
+  int schedule;
+  int tilex, tiley, tile;
+  int converge;
+  convergence conv;
+  int refine;
+  double refine_tol;
+  double slice;
+  int series;
+  double times[SERIES_MAX]; /**< The times of the series, log-spaced from series_tmin to tend */
+  int threads;
+  int compact;
+  int local_ic;
+  double angle[3]; /**< The initial angles */
+  double action3; /**< The initial third action */
+  int samples; /**< The initial angles per pixel */
+  int values; /**< The number of values of a pixel, with the coordinates */
+  int columns; /**< The number of columns of the result */
+} parameters;
+
+static parameters cache = {.pid = -1};
+
+/**
+ * Returns the parameters of the pool. The options are parsed on the first call within
+ * the pool, on the master and the workers alike, the next calls only read the cache
+ */
+static parameters* Parameters(pool *p, setup *s) {
+  double tmin;
+  int i;
+
+  if (cache.pid == p->pid) return &cache;
+
+  cache.pid = p->pid;
+
+  cache.step = LRC_option2double("arnold", "step", s->head);
+  cache.step = cache.step*(pow(5,0.5)-1)/2.0;
+  cache.tend = LRC_option2double("arnold", "tend", s->head);
+
+  cache.eps_interval = LRC_option2double("arnold", "eps_interval", s->head);
+  cache.epsmax = LRC_option2double("arnold", "epsmax", s->head);
+  cache.eps_skip = LRC_option2double("arnold", "eps_skip", s->head);
+  cache.eps = LRC_option2double("arnold", "eps", s->head) + p->pid*cache.eps_interval;
+
+  /* Global map range (equivalent of frequencies space) */
+  cache.xmin = LRC_option2double("arnold", "xmin", s->head);
+  cache.xmax = LRC_option2double("arnold", "xmax", s->head);
+  cache.ymin = LRC_option2double("arnold", "ymin", s->head);
+  cache.ymax = LRC_option2double("arnold", "ymax", s->head);
+
+  cache.driver = LRC_option2int("arnold", "driver", s->head);
+  cache.corrector = LRC_option2int("arnold", "corrector", s->head);
+  cache.rotate = LRC_option2int("arnold", "rotate", s->head);
+  cache.megno_stride = LRC_option2int("arnold", "megno_stride", s->head);
+  cache.checkout = LRC_option2int("arnold", "checkout", s->head);
+  cache.instrument = LRC_option2int("arnold", "instrument", s->head);
+  cache.schedule = LRC_option2int("arnold", "schedule", s->head);
+
+  cache.tilex = LRC_option2int("arnold", "tilex", s->head);
+  cache.tiley = LRC_option2int("arnold", "tiley", s->head);
+  cache.tile = cache.tilex*cache.tiley;
+
+  cache.converge = LRC_option2int("arnold", "converge", s->head);
+  cache.conv.tmin = LRC_option2double("arnold", "conv_tmin", s->head);
+  cache.conv.regular = LRC_option2double("arnold", "conv_regular", s->head);
+  cache.conv.chaotic = LRC_option2double("arnold", "conv_chaotic", s->head);
+
+  cache.refine = LRC_option2int("arnold", "refine", s->head);
+  cache.refine_tol = LRC_option2double("arnold", "refine_tol", s->head);
+
+  /* The time slices integrate the tile directly, without the refinement */
+  cache.slice = LRC_option2double("arnold", "slice", s->head);
+  if (cache.slice < 0.0) cache.slice = 0.0;
+
+  cache.series = LRC_option2int("arnold", "series", s->head);
+  if (cache.series < 0) cache.series = 0;
+  if (cache.series > SERIES_MAX) cache.series = SERIES_MAX;
+  tmin = LRC_option2double("arnold", "series_tmin", s->head);
+  if (tmin <= 0.0 || tmin > cache.tend) tmin = cache.tend;
+  for (i = 0; i < cache.series; i++) {
+    cache.times[i] = cache.tend;
+    if (cache.series > 1) cache.times[i] = tmin*pow(cache.tend/tmin, i/(cache.series-1.0));
+  }
+
+  /* Threads of the hybrid MPI/OpenMP build, set by TaskProcess() */
+  cache.threads = LRC_option2int("arnold", "threads", s->head);
+
+  cache.local_ic = LRC_option2int("arnold", "local_ic", s->head);
+
+  cache.angle[0] = LRC_option2double("arnold", "angle1", s->head);
+  cache.angle[1] = LRC_option2double("arnold", "angle2", s->head);
+  cache.angle[2] = LRC_option2double("arnold", "angle3", s->head);
+  cache.action3 = LRC_option2double("arnold", "action3", s->head);
+  cache.samples = LRC_option2int("arnold", "samples", s->head);
+  if (cache.samples < 1) cache.samples = 1;
+
+  /* x, y, MEGNO, err (+ the stop time) (+ ticks, steps, kicks, task time) (+ the max MEGNO) */
+  cache.values = 4;
+  if (cache.converge) cache.values++;
+  if (cache.instrument) cache.values += 4;
+  if (cache.samples > 1) cache.values++;
+
+  /* The compact result: the values without x, y, two float32 per column */
+  cache.compact = LRC_option2int("arnold", "compact", s->head);
+  cache.columns = cache.compact ? (cache.values - 1)/2 : cache.values;
+
+  return &cache;
+}
+
+/**
+ * The initial condition of the map pixel (i, j): the angles and I3 of the options, and the
+ * actions I1, I2 on the pixel grid
+ */
+static void InitialCondition(pool *p, parameters *a, int i, int j, double *x) {
+  x[0] = a->angle[0];
+  x[1] = a->angle[1];
+  x[2] = a->angle[2];
+  x[3] = a->xmin + i*(a->xmax-a->xmin)/(1.0*p->board->layout.dim[1]*a->tilex);
+  x[4] = a->ymin + j*(a->ymax-a->ymin)/(1.0*p->board->layout.dim[0]*a->tiley);
+  x[5] = a->action3;
+}
+
+/**
+ * Shifts the angles of the initial condition to the sample m of the lattice, the point m of
+ * the R3 sequence (Roberts, 2018) over the torus. The sample 0 is the initial condition itself
+ */
+static void LatticeSample(int m, double *x) {
+  const double g = 1.22074408460575947536, twopi = 6.28318530717958647693;
+  double alpha, u;
+  int i;
+
+  alpha = 1.0;
+  for (i = 0; i < 3; i++) {
+    alpha = alpha/g;
+    u = m*alpha;
+    x[i] = x[i] + twopi*(u - floor(u));
+  }
+}
+
+/**
+ * Stores the value c of a pixel (in the order x, y, MEGNO, err, ...) in its result row.
+ * The compact result drops x and y, and packs the values as float32, two per column
+ */
+static void ResultSet(parameters *a, double *row, int c, double v) {
+  float f;
+
+  if (!a->compact) {
+    row[c] = v;
+  } else if (c >= 2) {
+    f = (float) v;
+    memcpy((char*) row + (c-2)*sizeof(float), &f, sizeof(float));
+  }
+}
+
+/**
+ * Reads the value c of a pixel from its result row
+ */
+static double ResultGet(parameters *a, double *row, int c) {
+  float f;
+
+  if (!a->compact) return row[c];
+  if (c < 2) return 0.0;
+
+  memcpy(&f, (char*) row + (c-2)*sizeof(float), sizeof(float));
+
+  return (double) f;
+}
+
 /**
  * @brief Implements Storage()
  */
 int Storage(pool *p, setup *s) {
+  parameters *a = Parameters(p, s);
+  int skip;
+
+  skip = (a->eps_skip > 0.0);
+
+  /**
+   * Path: /Pools/pool-ID/eps
+   */
+  p->storage[0].layout = (schema) {
+    .path = "eps",
+    .rank = 2,
+    .dim[0] = 1,
+    .dim[1] = 1,
+    .use_hdf = 1,
+    .storage_type = STORAGE_BASIC,
+  };
+
+  /**
+   * The MEGNO map of the previous pool (map row, map column), kept on the master. The tasks
+   * take the values of their tiles in TaskPrepare()
+   */
+  p->storage[1].layout = (schema) {
+    .path = "previous",
+    .rank = 2,
+    .dim[0] = skip ? p->board->layout.dim[0]*a->tiley : 1,
+    .dim[1] = skip ? p->board->layout.dim[1]*a->tilex : 1,
+    .use_hdf = 0,
+    .storage_type = STORAGE_BASIC,
+  };
+
+  /**
+   * Path: /Pools/pool-ID/order
+   *
+   * The board cell of each task ID in the cost-aware scheduling
+   */
+  p->storage[2].layout = (schema) {
+    .path = "order",
+    .rank = 2,
+    .dim[0] = a->schedule ? p->board->layout.dim[0]*p->board->layout.dim[1] : 1,
+    .dim[1] = 1,
+    .use_hdf = 1,
+    .sync = 1,
+    .storage_type = STORAGE_BASIC,
+  };
+
+  /**
+   * Path: /Pools/pool-ID/times
+   *
+   * The times of the series points
+   */
+  p->storage[3].layout = (schema) {
+    .path = "times",
+    .rank = 2,
+    .dim[0] = a->series ? a->series : 1,
+    .dim[1] = 1,
+    .use_hdf = (a->series > 0),
+    .storage_type = STORAGE_BASIC,
+  };
+
+  /**
+   * Path: /Pools/pool-ID/map
+   *
+   * The map range and size in pixels: xmin, xmax, ymin, ymax, width, height, and the tile
+   * size tilex, tiley. The pixel (i, j) lies at x = xmin + i*(xmax-xmin)/width,
+   * y = ymin + j*(ymax-ymin)/height. The row k of the task at the board location
+   * (row, column) is the pixel i = column*tilex + k%tilex, j = row*tiley + k/tilex
+   */
+  p->storage[4].layout = (schema) {
+    .path = "map",
+    .rank = 2,
+    .dim[0] = 1,
+    .dim[1] = 8,
+    .use_hdf = 1,
+    .storage_type = STORAGE_BASIC,
+  };
+
+  /**
+   * Path: /Pools/pool-ID/layout
+   *
+   * The stored values of a result row, in order: the quantity (AWEB_COLUMN_X ...
+   * AWEB_COLUMN_MAX) and the size of the value in bytes, 8 for a double, 4 for a float32
+   * packed with compact = 1. The compact rows drop the x and y values
+   */
+  p->storage[5].layout = (schema) {
+    .path = "layout",
+    .rank = 2,
+    .dim[0] = a->compact ? a->values - 2 : a->values,
+    .dim[1] = 2,
+    .use_hdf = 1,
+    .storage_type = STORAGE_BASIC,
+  };
 
   /**
    * Path: /Pools/pool-ID/Tasks/input
+   *
+   * Each task integrates a tile of tilex*tiley map pixels, one row per pixel. With local_ic
+   * the workers compute the initial conditions, and the bank is a placeholder
    */
   p->task->storage[0].layout = (schema) {
     .path = "input",
     .rank = 2,
-    .dim[0] = 1,
-    .dim[1] = 6,
+    .dim[0] = a->local_ic ? 1 : a->tile,
+    .dim[1] = a->local_ic ? 1 : 6,
     .use_hdf = 0,
     .storage_type = STORAGE_PM3D,
   };
@@ -146,71 +617,541 @@ int Storage(pool *p, setup *s) {
   p->task->storage[1].layout = (schema) {
     .path = "result",
     .rank = 2,
-    .dim[0] = 1,
-    .dim[1] = 4,
+    .dim[0] = a->tile,
+    .dim[1] = a->columns,
     .use_hdf = 1,
     .storage_type = STORAGE_PM3D,
   };
 
+  /**
+   * Path: /Pools/pool-ID/Tasks/state
+   *
+   * The serialized orbits of the time slices, AWEB_STATE values per pixel. The bank goes
+   * with the task between the master and the worker, and into the checkpoints, so that
+   * a restarted task continues from the last slice
+   */
+  p->task->storage[2].layout = (schema) {
+    .path = "state",
+    .rank = 2,
+    .dim[0] = (a->slice > 0.0) ? a->tile*a->samples : 1,
+    .dim[1] = AWEB_STATE,
+    .use_hdf = (a->slice > 0.0),
+    .sync = 1,
+    .storage_type = STORAGE_PM3D,
+  };
+
+  /**
+   * Path: /Pools/pool-ID/Tasks/series
+   *
+   * <Y> and the relative energy error of each pixel at the times of the series, in pairs.
+   * The points not reached by the orbit (early termination, interpolated or skipped pixels)
+   * are zero
+   */
+  p->task->storage[3].layout = (schema) {
+    .path = "series",
+    .rank = 2,
+    .dim[0] = a->series ? a->tile : 1,
+    .dim[1] = a->series ? 2*a->series : 1,
+    .use_hdf = (a->series > 0),
+    .sync = 1,
+    .storage_type = STORAGE_PM3D,
+  };
+
+  /**
+   * The MEGNO of the tile pixels in the previous pool, sent with the task for eps_skip
+   */
+  p->task->storage[4].layout = (schema) {
+    .path = "previous",
+    .rank = 2,
+    .dim[0] = skip ? a->tile : 1,
+    .dim[1] = 1,
+    .use_hdf = 0,
+    .sync = 1,
+    .storage_type = STORAGE_PM3D,
+  };
+
+  return SUCCESS;
+}
+
+/**
+ * The maximum number of tiles integrated in the pre-pass of the scheduling
+ */
+#define SCHEDULE_MAX 256
+
+/**
+ * The predicted cost of a board cell
+ */
+typedef struct {
+  double cost;
+  int cell;
+} prediction;
+
+static int CostCompare(const void *a, const void *b) {
+  const prediction *x = a, *y = b;
+
+  if (x->cost > y->cost) return -1;
+  if (x->cost < y->cost) return 1;
+
+  return x->cell - y->cell;
+}
+
+/**
+ * The cost-aware scheduling: orders the board cells by their predicted cost, the most
+ * expensive first.
+ *
+ * The cost of a tile is taken from the previous pool, which differs only by eps_interval:
+ * the sum of the ticks of its pixels (instrument = 1) or of their stop times (converge = 1),
+ * the pixels skipped by eps_skip cost nothing. The first pool has no previous map, with
+ * converge = 1 a coarse pre-pass integrates up to 2*conv_tmin the center pixels of every
+ * k-th tile in both directions, k chosen so that at most SCHEDULE_MAX tiles are sampled,
+ * and each tile takes the stop time of the sampled tile of its kxk block. Otherwise all
+ * tasks cost the same and keep the board order
+ */
+static int Schedule(pool **allpools, pool *p, parameters *a) {
+  prediction *cost;
+  pool *prev;
+  integrator in;
+  double *xv[6], *megno, *err, *tstop, *row, x[6], c;
+  int ncells, nx, ny, mx, my, ns, stride, tid, cell, col, ci, cj, i, j, k;
+
+  nx = p->board->layout.dim[1];
+  ny = p->board->layout.dim[0];
+  ncells = nx*ny;
+
+  cost = malloc(ncells*sizeof(prediction));
+  if (!cost) return CORE_ERR_MEM;
+
+  for (cell = 0; cell < ncells; cell++) {
+    cost[cell].cost = 0.0;
+    cost[cell].cell = cell;
+  }
+
+  col = -1;
+  if (a->converge) col = 4;
+  if (a->instrument) col = a->converge ? 5 : 4;
+
+  if (p->pid > 0 && col > 0) {
+    prev = allpools[p->pid-1];
+    for (tid = 0; tid < prev->pool_size; tid++) {
+      cell = prev->tasks[tid]->location[0]*nx + prev->tasks[tid]->location[1];
+      for (k = 0; k < a->tile; k++) {
+        row = prev->tasks[tid]->storage[1].data[k];
+        if (a->eps_skip > 0.0 && ResultGet(a, row, 2) > a->eps_skip) continue;
+        cost[cell].cost += ResultGet(a, row, col);
+      }
+    }
+  } else if (a->converge) {
+
+    /* The stride of the sampled tiles, so that the pre-pass has a fixed cost */
+    stride = 1;
+    do {
+      mx = (nx + stride - 1)/stride;
+      my = (ny + stride - 1)/stride;
+      ns = mx*my;
+      if (ns > SCHEDULE_MAX) stride++;
+    } while (ns > SCHEDULE_MAX);
+
+    xv[0] = malloc(9*ns*sizeof(double));
+    if (!xv[0]) {
+      free(cost);
+      return CORE_ERR_MEM;
+    }
+    for (i = 1; i < 6; i++) xv[i] = xv[0] + i*ns;
+    megno = xv[0] + 6*ns;
+    err = xv[0] + 7*ns;
+    tstop = xv[0] + 8*ns;
+
+    /* The center pixel of the center tile of each block, as in TaskPrepare() */
+    for (j = 0; j < my; j++) {
+      for (i = 0; i < mx; i++) {
+        tid = j*mx + i;
+        ci = (i*stride + stride/2 < nx) ? i*stride + stride/2 : nx - 1;
+        cj = (j*stride + stride/2 < ny) ? j*stride + stride/2 : ny - 1;
+        InitialCondition(p, a, ci*a->tilex + a->tilex/2, cj*a->tiley + a->tiley/2, x);
+        for (k = 0; k < 6; k++) xv[k][tid] = x[k];
+      }
+    }
+
+    memset(&in, 0, sizeof(in));
+    in.driver = a->driver;
+    in.corrector = a->corrector;
+    in.rotate = a->rotate;
+    in.stride = a->megno_stride;
+    in.checkout = a->checkout;
+    in.step = a->step;
+    in.tend = 2.0*a->conv.tmin;
+    in.eps = a->eps;
+    in.key = (uint64_t) p->pid;
+    in.conv = &a->conv;
+
+    smegnov(&in, ns, xv, megno, err, tstop);
+
+    for (j = 0; j < ny; j++) {
+      for (i = 0; i < nx; i++) {
+        cost[j*nx + i].cost = tstop[(j/stride)*mx + i/stride];
+      }
+    }
+
+    free(xv[0]);
+  }
+
+  qsort(cost, ncells, sizeof(prediction), CostCompare);
+
+  c = 0.0;
+  for (tid = 0; tid < ncells; tid++) {
+    p->storage[2].data[tid][0] = (double) cost[tid].cell;
+    c += cost[tid].cost;
+  }
+
+  Message(MESSAGE_COMMENT, "Pool: %04d, tasks scheduled by the predicted cost (%g)\n",
+      p->pid, c);
+
+  free(cost);
+
+  return SUCCESS;
+}
+
+/**
+ * @brief Implements PoolPrepare()
+ *
+ * Each pool computes the map for its own perturbation parameter, eps + pid*eps_interval.
+ * With eps_skip enabled, the MEGNO map of the previous pool is gathered on the master.
+ * With schedule enabled, the order of the tasks is predicted. The times of the series, the
+ * map range and the layout of the result rows are stored with the pool
+ */
+int PoolPrepare(pool **allpools, pool *p, setup *s) {
+  parameters *a = Parameters(p, s);
+  pool *prev;
+  int tid, i, j, k;
+
+  p->storage[0].data[0][0] = a->eps;
+  for (i = 0; i < a->series; i++) p->storage[3].data[i][0] = a->times[i];
+
+  p->storage[4].data[0][0] = a->xmin;
+  p->storage[4].data[0][1] = a->xmax;
+  p->storage[4].data[0][2] = a->ymin;
+  p->storage[4].data[0][3] = a->ymax;
+  p->storage[4].data[0][4] = p->board->layout.dim[1]*a->tilex;
+  p->storage[4].data[0][5] = p->board->layout.dim[0]*a->tiley;
+  p->storage[4].data[0][6] = a->tilex;
+  p->storage[4].data[0][7] = a->tiley;
+
+  k = 0;
+  if (!a->compact) {
+    p->storage[5].data[k++][0] = AWEB_COLUMN_X;
+    p->storage[5].data[k++][0] = AWEB_COLUMN_Y;
+  }
+  p->storage[5].data[k++][0] = AWEB_COLUMN_MEGNO;
+  p->storage[5].data[k++][0] = AWEB_COLUMN_ERR;
+  if (a->converge) p->storage[5].data[k++][0] = AWEB_COLUMN_TSTOP;
+  if (a->instrument) {
+    p->storage[5].data[k++][0] = AWEB_COLUMN_TICKS;
+    p->storage[5].data[k++][0] = AWEB_COLUMN_STEPS;
+    p->storage[5].data[k++][0] = AWEB_COLUMN_KICKS;
+    p->storage[5].data[k++][0] = AWEB_COLUMN_ELAPSED;
+  }
+  if (a->samples > 1) p->storage[5].data[k++][0] = AWEB_COLUMN_MAX;
+  for (i = 0; i < k; i++) p->storage[5].data[i][1] = a->compact ? sizeof(float) : sizeof(double);
+
+  if (a->schedule) {
+    k = Schedule(allpools, p, a);
+    if (k != SUCCESS) return k;
+  }
+
+  if (p->pid == 0 || a->eps_skip <= 0.0) return SUCCESS;
+
+  prev = allpools[p->pid-1];
+  for (tid = 0; tid < prev->pool_size; tid++) {
+    for (j = 0; j < a->tiley; j++) {
+      for (i = 0; i < a->tilex; i++) {
+        k = j*a->tilex + i;
+        p->storage[1].data[prev->tasks[tid]->location[0]*a->tiley + j]
+          [prev->tasks[tid]->location[1]*a->tilex + i] =
+          ResultGet(a, prev->tasks[tid]->storage[1].data[k], 2);
+      }
+    }
+  }
+
+  return SUCCESS;
+}
+
+/**
+ * @brief Implements PoolProcess()
+ *
+ * Creates the pools of the epsilon sweep until epsmax is reached
+ */
+int PoolProcess(pool **allpools, pool *p, setup *s) {
+  parameters *a = Parameters(p, s);
+
+  if (a->eps_interval <= 0.0) return POOL_FINALIZE;
+  if (a->eps + a->eps_interval > a->epsmax + 1e-6*a->eps_interval) return POOL_FINALIZE;
+
+  return POOL_CREATE_NEW;
+}
+
+/**
+ * @brief Implements TaskBoardMap()
+ *
+ * Maps the task ID onto the board cell, in the row order, or in the order of the predicted
+ * cost with schedule enabled, so that the long tasks do not come last
+ */
+int TaskBoardMap(pool *p, task *t, setup *s) {
+  parameters *a = Parameters(p, s);
+  int cell;
+
+  cell = t->tid;
+  if (a->schedule) cell = (int) p->storage[2].data[t->tid][0];
+
+  t->location[0] = cell / p->board->layout.dim[1];
+  t->location[1] = cell % p->board->layout.dim[1];
+
   return SUCCESS;
 }
 
 /**
  * @brief Implements TaskPrepare()
+ *
+ * The task at the board location (row, column) covers the map pixels
+ * [row*tiley, (row+1)*tiley) x [column*tilex, (column+1)*tilex), so that the map has
+ * (tilex*board columns) x (tiley*board rows) pixels. With eps_skip enabled, the task gets
+ * the previous MEGNO of its own pixels only
  */
 int TaskPrepare(pool *p, task *t, setup *s) {
-  double xmin, xmax, ymin, ymax;
+  parameters *a = Parameters(p, s);
+  int i, j, k;
 
-  /* Global map range (equivalent of frequencies space) */
-  xmin = LRC_option2double("arnold", "xmin", s->head);
-  xmax = LRC_option2double("arnold", "xmax", s->head);
-  ymin = LRC_option2double("arnold", "ymin", s->head);
-  ymax = LRC_option2double("arnold", "ymax", s->head);
+  if (p->pid > 0 && a->eps_skip > 0.0) {
+    for (j = 0; j < a->tiley; j++) {
+      for (i = 0; i < a->tilex; i++) {
+        k = j*a->tilex + i;
+        t->storage[4].data[k][0] =
+          p->storage[1].data[t->location[0]*a->tiley + j][t->location[1]*a->tilex + i];
+      }
+    }
+  }
 
-  /* Initial condition - angles */
-  t->storage[0].data[0][0] = 0.131;
-  t->storage[0].data[0][1] = 0.132;
-  t->storage[0].data[0][2] = 0.212;
+  /* The workers compute the initial conditions themselves */
+  if (a->local_ic) return SUCCESS;
 
-  /* Map coordinates */
-  t->storage[0].data[0][3] = xmin + t->location[1]*(xmax-xmin)/(1.0*p->board->layout.dim[1]);
-  t->storage[0].data[0][4] = ymin + t->location[0]*(ymax-ymin)/(1.0*p->board->layout.dim[0]);
-  t->storage[0].data[0][5] = 0.01;
+  for (j = 0; j < a->tiley; j++) {
+    for (i = 0; i < a->tilex; i++) {
+      k = j*a->tilex + i;
+      InitialCondition(p, a, t->location[1]*a->tilex + i, t->location[0]*a->tiley + j,
+          t->storage[0].data[k]);
+    }
+  }
 
   return SUCCESS;
 }
 
 /**
  * @brief Implements TaskProcess()
+ *
+ * The whole tile is integrated with the batched kernel, shared by the OpenMP threads of
+ * the worker in the hybrid build, and returned to the master in one message. With the
+ * refinement enabled, only the coarse grid and the cells where the MEGNO changes are
+ * integrated, the remaining pixels are interpolated. With eps_skip enabled, the pixels that
+ * were strongly chaotic at the previous eps are not integrated again, they inherit the
+ * previous MEGNO and zero error.
+ *
+ * With slice > 0 each run of the task integrates the orbits of the tile over one slice of
+ * the time, and saves them in the state bank. The task is restarted until all orbits are
+ * done, the result holds the values reached so far.
+ *
+ * With samples > 1 each pixel is integrated for the lattice of initial angles, the samples
+ * of a pixel are neighbours in the batch. The pixel gets the mean and the max MEGNO, the max
+ * error and stop time, the sum of the counters, and the series of its first sample
  */
 int TaskProcess(pool *p, task *t, setup *s) {
-  double err, xv[6], tend, step, eps, result = 0.0;
-  int driver = 0;
-
-  step = LRC_option2double("arnold", "step", s->head);
-  step = step*(pow(5,0.5)-1)/2.0;
-  tend = LRC_option2double("arnold", "tend", s->head);
-  eps = LRC_option2double("arnold", "eps", s->head);
-
-  driver = LRC_option2int("arnold", "driver", s->head);
-
-  /* Initial data */
-  xv[0] = t->storage[0].data[0][0];
-  xv[1] = t->storage[0].data[0][1];
-  xv[2] = t->storage[0].data[0][2];
-  xv[3] = t->storage[0].data[0][3];
-  xv[4] = t->storage[0].data[0][4];
-  xv[5] = t->storage[0].data[0][5];
-
-  /* Numerical integration goes here */
-  if (driver == 1) result = smegno2(xv, step, tend, eps, &err);
-  if (driver == 2) result = smegno3(xv, step, tend, eps, &err);
-
-  /* Assign the master result */
-  t->storage[1].data[0][0] = xv[3];
-  t->storage[1].data[0][1] = xv[4];
-  t->storage[1].data[0][2] = result;
-  t->storage[1].data[0][3] = err;
+  parameters *a = Parameters(p, s);
+  integrator in;
+  counters cnt;
+  double *xv[6], *result, *err, *tstop;
+  double start, elapsed, *state = NULL, *ts = NULL, *row, x[6], ymax;
+  char *known = NULL;
+  int tile, samples, n, pending, nx, ny, i, j, k, m, o, c;
+
+  start = MPI_Wtime();
+  tile = a->tile;
+  samples = a->samples;
+  n = tile*samples;
+
+  xv[0] = malloc(12*n*sizeof(double));
+  if (!xv[0]) return CORE_ERR_MEM;
+  for (i = 1; i < 6; i++) xv[i] = xv[0] + i*n;
+  result = xv[0] + 6*n;
+  err = xv[0] + 7*n;
+  tstop = xv[0] + 8*n;
+  cnt.ticks = xv[0] + 9*n;
+  cnt.steps = xv[0] + 10*n;
+  cnt.kicks = xv[0] + 11*n;
+
+  /* Initial data, from the master or from the board location of the task */
+  for (j = 0; j < a->tiley; j++) {
+    for (i = 0; i < a->tilex; i++) {
+      k = j*a->tilex + i;
+      for (m = 0; m < samples; m++) {
+        if (a->local_ic) {
+          InitialCondition(p, a, t->location[1]*a->tilex + i, t->location[0]*a->tiley + j, x);
+        } else {
+          for (c = 0; c < 6; c++) x[c] = t->storage[0].data[k][c];
+        }
+        if (m > 0) LatticeSample(m, x);
+        for (c = 0; c < 6; c++) xv[c][k*samples + m] = x[c];
+      }
+    }
+  }
+
+  /* Chaotic pixels of the previous pool */
+  if (p->pid > 0 && a->eps_skip > 0.0) {
+    known = malloc(n*sizeof(char));
+    if (!known) {
+      free(xv[0]);
+      return CORE_ERR_MEM;
+    }
+    for (k = 0; k < tile; k++) {
+      for (m = 0; m < samples; m++) {
+        o = k*samples + m;
+        result[o] = t->storage[4].data[k][0];
+        err[o] = tstop[o] = 0.0;
+        known[o] = (result[o] > a->eps_skip);
+      }
+    }
+  }
+
+  /* Threads of the hybrid MPI/OpenMP build, each one runs its own lane block */
+#ifdef _OPENMP
+  if (a->threads > 0) omp_set_num_threads(a->threads);
+#endif
+
+  /* Numerical integration goes here, the tangent vectors are keyed by the pool */
+  in.driver = a->driver;
+  in.corrector = a->corrector;
+  in.rotate = a->rotate;
+  in.stride = a->megno_stride;
+  in.checkout = a->checkout;
+  in.step = a->step;
+  in.tend = a->tend;
+  in.eps = a->eps;
+  in.key = (uint64_t) p->pid;
+  in.conv = a->converge ? &a->conv : NULL;
+  in.cnt = a->instrument ? &cnt : NULL;
+  in.slice = 0.0;
+  in.state = NULL;
+  in.series = 0;
+  in.times = NULL;
+  in.ts = NULL;
+
+  /* The series of the previous slices are continued */
+  if (a->series > 0) {
+    ts = calloc(n*2*a->series, sizeof(double));
+    if (!ts) {
+      free(xv[0]);
+      free(known);
+      return CORE_ERR_MEM;
+    }
+    if (a->slice > 0.0) {
+      for (k = 0; k < tile; k++) {
+        o = k*samples;
+        for (i = 0; i < 2*a->series; i++) ts[o*2*a->series + i] = t->storage[3].data[k][i];
+      }
+    }
+    in.series = a->series;
+    in.times = a->times;
+    in.ts = ts;
+  }
+
+  pending = 0;
+  if (a->slice > 0.0) {
+    state = malloc(n*AWEB_STATE*sizeof(double));
+    if (!state) {
+      free(xv[0]);
+      free(known);
+      free(ts);
+      return CORE_ERR_MEM;
+    }
+
+    for (o = 0; o < n; o++) {
+      for (i = 0; i < AWEB_STATE; i++) state[o*AWEB_STATE + i] = t->storage[2].data[o][i];
+
+      /* The first slice: the known pixels are done */
+      if (known && known[o] && state[o*AWEB_STATE + AWEB_STATE_STATUS] == AWEB_FRESH) {
+        for (i = 0; i < AWEB_STATE; i++) state[o*AWEB_STATE + i] = 0.0;
+        state[o*AWEB_STATE + AWEB_STATE_MY] = result[o];
+        state[o*AWEB_STATE + AWEB_STATE_STATUS] = AWEB_FINISHED;
+      }
+    }
+
+    in.slice = a->slice;
+    in.state = state;
+    if (in.cnt) {
+      for (o = 0; o < n; o++) cnt.ticks[o] = cnt.steps[o] = cnt.kicks[o] = 0.0;
+    }
+
+    smegnov(&in, n, xv, result, err, tstop);
+
+    for (o = 0; o < n; o++) {
+      for (i = 0; i < AWEB_STATE; i++) t->storage[2].data[o][i] = state[o*AWEB_STATE + i];
+      if (state[o*AWEB_STATE + AWEB_STATE_STATUS] != AWEB_FINISHED) pending++;
+    }
+  } else {
+
+    /* The samples are not refined, they form a single row of the orbits */
+    nx = (samples > 1) ? n : a->tilex;
+    ny = (samples > 1) ? 1 : a->tiley;
+    smegno_refine(&in, nx, ny, xv, (samples > 1) ? 1 : a->refine, a->refine_tol, known,
+        result, err, tstop);
+  }
+  elapsed = MPI_Wtime() - start;
+
+  /* Assign the master result, the samples of the pixel are reduced in place */
+  for (k = 0; k < tile; k++) {
+    o = k*samples;
+    ymax = result[o];
+    for (m = 1; m < samples; m++) {
+      result[o] += result[o + m];
+      if (result[o + m] > ymax) ymax = result[o + m];
+      if (err[o + m] > err[o]) err[o] = err[o + m];
+      if (tstop[o + m] > tstop[o]) tstop[o] = tstop[o + m];
+      if (in.cnt) {
+        cnt.ticks[o] += cnt.ticks[o + m];
+        cnt.steps[o] += cnt.steps[o + m];
+        cnt.kicks[o] += cnt.kicks[o + m];
+      }
+    }
+    result[o] = result[o]/samples;
+
+    row = t->storage[1].data[k];
+    if (a->compact) row[a->columns-1] = 0.0;
+    ResultSet(a, row, 0, xv[3][o]);
+    ResultSet(a, row, 1, xv[4][o]);
+    ResultSet(a, row, 2, result[o]);
+    ResultSet(a, row, 3, err[o]);
+    c = 4;
+    if (a->converge) ResultSet(a, row, c++, tstop[o]);
+    if (a->instrument) {
+      ResultSet(a, row, c++, cnt.ticks[o]);
+      ResultSet(a, row, c++, cnt.steps[o]);
+      ResultSet(a, row, c++, cnt.kicks[o]);
+      ResultSet(a, row, c++, elapsed);
+    }
+    if (samples > 1) ResultSet(a, row, c++, ymax);
+  }
+
+  if (ts) {
+    for (k = 0; k < tile; k++) {
+      o = k*samples;
+      for (i = 0; i < 2*a->series; i++) t->storage[3].data[k][i] = ts[o*2*a->series + i];
+    }
+  }
+
+  free(xv[0]);
+  free(known);
+  free(state);
+  free(ts);
+
+  /* The orbits left after this slice continue in the next run of the task */
+  if (pending > 0) t->status = TASK_TO_BE_RESTARTED;
 
   return SUCCESS;
 }
@@ -1,7 +1,120 @@
 #ifndef MECHANIC_MODULE_ARNOLDWEB_H
 #define MECHANIC_MODULE_ARNOLDWEB_H
 
+#include <stdint.h>
+
+/**
+ * The number of initial conditions integrated together by the batched kernel
+ * (one AVX-512 register or two AVX2 registers of doubles)
+ */
+#define AWEB_LANES 8
+
+/**
+ * The early termination thresholds of the MEGNO integration
+ */
+typedef struct {
+  double tmin; /**< No classification before this time */
+  double regular; /**< Regular orbit: |<Y>-2| below this value over the second half of the run */
+  double chaotic; /**< Chaotic orbit: <Y> above this value */
+} convergence;
+
+/**
+ * The symplectic integrators (the driver option)
+ */
+#define AWEB_SABA2 1
+#define AWEB_SABA3 2
+#define AWEB_SABA4 3
+#define AWEB_SBAB2 4
+#define AWEB_SBAB3 5
+#define AWEB_SBAB4 6
+#define AWEB_YOSHIDA4 7
+
+/**
+ * The per-orbit instrumentation of the integration
+ */
+typedef struct {
+  double *ticks; /**< The time stamp counter ticks while the orbit held its lane */
+  double *steps; /**< The integration steps */
+  double *kicks; /**< The calls of the interaction (kicks of the lane block) */
+} counters;
+
+/**
+ * The serialized state of an orbit, AWEB_STATE doubles: the state and tangent vectors,
+ * the MEGNO sums, the step count, the energy error and reference, the classification time,
+ * the counters, the classification flag, the status and the next point of the time series,
+ * and in the rotation mode the sin/cos of the angles and the rotors (AWEB_ROTORS drifts, the
+ * cos and sin of the first two angles each). An orbit paused after a time slice continues
+ * from here
+ */
+#define AWEB_ROTORS 6
+#define AWEB_STATE (31 + 4*AWEB_ROTORS)
+#define AWEB_STATE_XV 0
+#define AWEB_STATE_DY 6
+#define AWEB_STATE_Y 12
+#define AWEB_STATE_MY 13
+#define AWEB_STATE_DELTA0 14
+#define AWEB_STATE_KS 15
+#define AWEB_STATE_NS 16
+#define AWEB_STATE_MAXE 17
+#define AWEB_STATE_EN0 18
+#define AWEB_STATE_SINCE 19
+#define AWEB_STATE_TICKS 20
+#define AWEB_STATE_KICKS 21
+#define AWEB_STATE_STOP 22
+#define AWEB_STATE_STATUS 23
+#define AWEB_STATE_SERIES 24
+#define AWEB_STATE_SF 25
+#define AWEB_STATE_CF 28
+#define AWEB_STATE_ROT 31
+
+/**
+ * The status of a serialized orbit
+ */
+#define AWEB_FRESH 0
+#define AWEB_PAUSED 1
+#define AWEB_FINISHED 2
+
+/**
+ * The quantities of the result columns, listed in /Pools/pool-ID/layout
+ */
+#define AWEB_COLUMN_X 0
+#define AWEB_COLUMN_Y 1
+#define AWEB_COLUMN_MEGNO 2
+#define AWEB_COLUMN_ERR 3
+#define AWEB_COLUMN_TSTOP 4
+#define AWEB_COLUMN_TICKS 5
+#define AWEB_COLUMN_STEPS 6
+#define AWEB_COLUMN_KICKS 7
+#define AWEB_COLUMN_ELAPSED 8
+#define AWEB_COLUMN_MAX 9
+
+/**
+ * The settings of the MEGNO integration
+ */
+typedef struct {
+  int driver; /**< The symplectic integrator, AWEB_SABA2 ... AWEB_YOSHIDA4 */
+  int corrector; /**< Apply the corrector of Laskar & Robutel (SABAn, SBABn) */
+  int rotate; /**< Advance the sin/cos of the angles by rotations in the drifts */
+  int stride; /**< Sample the MEGNO every stride steps, 0 - every step */
+  int checkout; /**< Check the energy every checkout steps, 0 - every 1000 steps */
+  double step; /**< The time step */
+  double tend; /**< The integration time */
+  double eps; /**< The perturbation parameter */
+  uint64_t key; /**< The key of the tangent vectors */
+  const convergence *conv; /**< The early termination thresholds, NULL - off */
+  counters *cnt; /**< The instrumentation, NULL - off */
+  double slice; /**< Pause the orbits after this integration time, 0 - off (needs state) */
+  double *state; /**< The orbit states, AWEB_STATE doubles per orbit, NULL - off */
+  int series; /**< The number of points of the time series, 0 - off */
+  const double *times; /**< The times of the series points, increasing */
+  double *ts; /**< The series: <Y> and the relative energy error at each time, 2*series per orbit */
+} integrator;
+
 double smegno2(double *xv, double step, double tend, double eps, double *err);
 double smegno3(double *xv, double step, double tend, double eps, double *err);
+void smegnov(const integrator *in, int n, double **xv, double *megno, double *err,
+    double *tstop);
+void smegno_refine(const integrator *in, int nx, int ny, double **xv, int stride, double tol,
+    const char *known, double *megno, double *err, double *tstop);
 
 #endif
@@ -0,0 +1,211 @@
+/**
+ * @file
+ * The Arnold Web module for Mechanic: the standalone benchmark of the integrators
+ *
+ * The benchmark links only the Arnold Web part (mechanic_module_aweb_lib.c), so the
+ * kernels are timed without MPI, HDF5 and the task farm. It sweeps the driver, the
+ * step, the integration time and the perturbation parameter over a fixed set of
+ * initial conditions, and reports for each setting the time per step and initial
+ * condition, the maximum relative energy error and the mean MEGNO.
+ *
+ * Usage:
+ *
+ *   aweb_bench [-w file] [-r file] [-t tol] [-c] [-o] [-s stride]
+ *
+ *   -w file  write the MEGNO and the energy errors of all runs to the reference file
+ *   -r file  compare the runs with the reference file, exit with 1 on a deviation
+ *   -t tol   the MEGNO tolerance, |Y - Yref| <= tol*max(1, |Yref|), default 1e-3
+ *   -c       enable the corrector
+ *   -o       enable the rotation mode
+ *   -s n     sample the MEGNO every n steps
+ *
+ * A run deviates when its MEGNO is off by more than the tolerance, or its energy error
+ * grew more than ten times over the reference one.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "mechanic_module_aweb.h"
+
+/**
+ * The initial conditions: BENCH_SIDE x BENCH_SIDE actions over the default map
+ */
+#define BENCH_SIDE 4
+#define BENCH_IC (BENCH_SIDE*BENCH_SIDE)
+
+static const int drivers[] = {AWEB_SABA2, AWEB_SABA3, AWEB_SABA4, AWEB_SBAB2, AWEB_SBAB3,
+  AWEB_SBAB4, AWEB_YOSHIDA4};
+static const double steps[] = {0.1, 0.25};
+static const double tends[] = {1000.0, 5000.0};
+static const double epss[] = {0.01, 0.04};
+
+#define COUNT(x) ((int) (sizeof(x)/sizeof(x[0])))
+
+/**
+ * The wall clock time in seconds
+ */
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/**
+ * Sets the initial conditions, the same angles as the module and the actions on a grid
+ * over [0.8, 1.2] x [0.8, 1.2]
+ */
+static void initial(double **xv) {
+  int i, j, k;
+
+  for (j = 0; j < BENCH_SIDE; j++) {
+    for (i = 0; i < BENCH_SIDE; i++) {
+      k = j*BENCH_SIDE + i;
+      xv[0][k] = 0.131;
+      xv[1][k] = 0.132;
+      xv[2][k] = 0.212;
+      xv[3][k] = 0.8 + (i + 0.5)*0.4/BENCH_SIDE;
+      xv[4][k] = 0.8 + (j + 0.5)*0.4/BENCH_SIDE;
+      xv[5][k] = 0.01;
+    }
+  }
+}
+
+/**
+ * Reads the reference value of a run, returns 0 if the run is not in the file
+ */
+static int reference(FILE *f, int driver, double step, double tend, double eps, int ic,
+    double *megno, double *err) {
+  int d, k;
+  double h, t, e, y, r;
+
+  rewind(f);
+  while (fscanf(f, "%d %lf %lf %lf %d %lf %lf", &d, &h, &t, &e, &k, &y, &r) == 7) {
+    if (d == driver && h == step && t == tend && e == eps && k == ic) {
+      *megno = y;
+      *err = r;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  integrator in;
+  double *xv[6], megno[BENCH_IC], err[BENCH_IC], tstop[BENCH_IC];
+  double t0, t1, ns, maxerr, mean, ymax, eref, tol;
+  FILE *wf = NULL, *rf = NULL;
+  int a, d, h, t, e, k, missing, failed;
+
+  memset(&in, 0, sizeof(in));
+  tol = 1e-3;
+
+  for (a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "-w") == 0 && a + 1 < argc) {
+      wf = fopen(argv[++a], "w");
+      if (!wf) {
+        fprintf(stderr, "Cannot write %s\n", argv[a]);
+        return 2;
+      }
+    } else if (strcmp(argv[a], "-r") == 0 && a + 1 < argc) {
+      rf = fopen(argv[++a], "r");
+      if (!rf) {
+        fprintf(stderr, "Cannot read %s\n", argv[a]);
+        return 2;
+      }
+    } else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+      tol = atof(argv[++a]);
+    } else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc) {
+      in.stride = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "-c") == 0) {
+      in.corrector = 1;
+    } else if (strcmp(argv[a], "-o") == 0) {
+      in.rotate = 1;
+    } else {
+      fprintf(stderr, "Usage: %s [-w file] [-r file] [-t tol] [-c] [-o] [-s stride]\n",
+          argv[0]);
+      return 2;
+    }
+  }
+
+  xv[0] = malloc(6*BENCH_IC*sizeof(double));
+  if (!xv[0]) return 2;
+  for (k = 1; k < 6; k++) xv[k] = xv[0] + k*BENCH_IC;
+
+  missing = 0;
+  failed = 0;
+
+  printf("# driver step tend eps ns/step max_energy_error mean_megno max_megno_deviation\n");
+
+  for (d = 0; d < COUNT(drivers); d++) {
+    for (h = 0; h < COUNT(steps); h++) {
+      for (t = 0; t < COUNT(tends); t++) {
+        for (e = 0; e < COUNT(epss); e++) {
+          in.driver = drivers[d];
+          in.step = steps[h];
+          in.tend = tends[t];
+          in.eps = epss[e];
+
+          initial(xv);
+          t0 = now();
+          smegnov(&in, BENCH_IC, xv, megno, err, tstop);
+          t1 = now();
+
+          ns = 1e9*(t1 - t0)/(BENCH_IC*in.tend/in.step);
+          maxerr = 0.0;
+          mean = 0.0;
+          ymax = 0.0;
+
+          for (k = 0; k < BENCH_IC; k++) {
+            if (err[k] > maxerr) maxerr = err[k];
+            mean += megno[k]/BENCH_IC;
+
+            if (wf) {
+              fprintf(wf, "%d %.17g %.17g %.17g %d %.17g %.17g\n", in.driver, in.step,
+                  in.tend, in.eps, k, megno[k], err[k]);
+            }
+
+            if (rf) {
+              double yref;
+              if (!reference(rf, in.driver, in.step, in.tend, in.eps, k, &yref, &eref)) {
+                missing++;
+                continue;
+              }
+              if (fabs(megno[k] - yref)/fmax(1.0, fabs(yref)) > ymax) {
+                ymax = fabs(megno[k] - yref)/fmax(1.0, fabs(yref));
+              }
+              if (!(fabs(megno[k] - yref) <= tol*fmax(1.0, fabs(yref)))
+                  || !(err[k] <= 10.0*eref + 1e-15)) {
+                fprintf(stderr, "Deviation: driver %d step %g tend %g eps %g ic %d: "
+                    "megno %.10g (reference %.10g), energy error %.3e (reference %.3e)\n",
+                    in.driver, in.step, in.tend, in.eps, k, megno[k], yref, err[k], eref);
+                failed++;
+              }
+            }
+          }
+
+          printf("%d %g %g %g %.3f %.3e %.6f %.3e\n", in.driver, in.step, in.tend, in.eps,
+              ns, maxerr, mean, ymax);
+        }
+      }
+    }
+  }
+
+  free(xv[0]);
+  if (wf) fclose(wf);
+  if (rf) {
+    fclose(rf);
+    if (missing) fprintf(stderr, "%d runs not found in the reference file\n", missing);
+    printf("# %d deviations, %d missing\n", failed, missing);
+  }
+
+  return (failed > 0 || missing > 0) ? 1 : 0;
+}
@@ -5,331 +5,1172 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
 
 #include "mechanic_module_aweb.h"
 
 /**
- * The right hand sides + variational equations of the Hamiltonian model of the Arnold web, 
- * see Froeschle+ Science 289 (2000)
+ * The maximum number of kicks per step of the symplectic integrators
  */
-void vinteraction(double *y,  double *a, double *dy, double *v, double eps) {
-  double I1, I2, I3, f1, f2, f3, sf1, sf2;
-  double sf3, cf1, cf2, cf3, dif, dif2, dif3, sum;
+#define STAGES 5
 
-  f1   = y[0];
-  f2   = y[1];
-  f3   = y[2];
-  I1   = y[3];
-  I2   = y[4];
-  I3   = y[5];
+#if STAGES + 1 > AWEB_ROTORS
+#error "The serialized state does not hold the rotors of all drifts"
+#endif
 
-  sf1  = sin(f1);
-  sf2  = sin(f2);
-  sf3  = sin(f3);
-  cf1  = cos(f1);
-  cf2  = cos(f2);
-  cf3  = cos(f3);
+/**
+ * The rotation mode: the sin/cos of the angles are renormalized every RENORM steps of the orbit
+ */
+#define RENORM 16
 
-  dif  = cf1 + cf2 + cf3 + 4;
-  dif2 = eps/(dif*dif);
-  dif3 = dif2/dif;
+/**
+ * The clock of the instrumentation: the time stamp counter (a single rdtsc), or the
+ * processor time on other architectures
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKS() ((double) __rdtsc())
+#else
+#define TICKS() ((double) clock())
+#endif
 
-  // right hand sides
-  a[0] =  I1;
-  a[1] =  I2;
-  a[2] =  1.0;
-  a[3] = -sf1*dif2;
-  a[4] = -sf2*dif2;
-  a[5] = -sf3*dif2;
+/**
+ * The lane block of the batched integrator.
+ *
+ * AWEB_LANES initial conditions are stored as a structure of arrays, so that each loop
+ * over the lanes maps onto AVX2/AVX-512 registers
+ */
+typedef struct {
+  double xv[6][AWEB_LANES];
+  double dy[6][AWEB_LANES];
+  double sf[3][AWEB_LANES];
+  double cf[3][AWEB_LANES];
+  double di[2][AWEB_LANES]; /**< The change of the first two actions in the last kick */
+  double tmp[AWEB_LANES];
+  int trig; /**< sf and cf hold the sin/cos of the current angles */
+  long int kicks; /**< The calls of vinteraction() */
+
+  /* The rotation mode */
+  int rot; /**< The drifts rotate sf and cf instead of invalidating them */
+  int nr; /**< The number of distinct drifts of the integrator */
+  int map[STAGES+1]; /**< The rotor of each drift, -1 for an empty drift */
+  double hr[STAGES+1]; /**< The distinct drift times */
+  double c3[STAGES+1], s3[STAGES+1]; /**< The rotors of the third angle (constant) */
+  double rc[STAGES+1][2][AWEB_LANES], rs[STAGES+1][2][AWEB_LANES]; /**< The first two angles */
+} lanes;
 
-  // variational equations
-  v[0] =  1;
-  v[1] =  1;
-  v[2] =  0;
+/**
+ * Rounds to the nearest integer without calling libm (vectorizes without SSE4.1)
+ */
+#define RNDMAGIC 6755399441055744.0
 
-  sum  = 2*(sf1*dy[0] + sf2*dy[1] + sf3*dy[2])*dif3;
+/**
+ * Vectorized sin/cos: Cody-Waite reduction to [-pi/4, pi/4] and the Cephes polynomials,
+ * accurate to 1-2 ulp for |x| < 1e9
+ */
+static void vsincos(const double *x, double *s, double *c, int n) {
+  const double P1 = 1.57079625129699707031e+00;
+  const double P2 = 7.54978941586159635336e-08;
+  const double P3 = 5.39030285815811905290e-15;
+  double j, q, r, z, ps, pc, ss, cc;
+  int l;
+
+  for (l = 0; l < n; l++) {
+    j = (x[l]*0.63661977236758134308 + RNDMAGIC) - RNDMAGIC;
+    q = j - 4.0*((j*0.25 + RNDMAGIC) - RNDMAGIC);
+
+    r = ((x[l] - j*P1) - j*P2) - j*P3;
+    z = r*r;
+
+    ps = r + r*z*(((((1.58962301576546568060e-10*z - 2.50507477628578072866e-8)*z
+      + 2.75573136213857245213e-6)*z - 1.98412698295895385996e-4)*z
+      + 8.33333333332211858878e-3)*z - 1.66666666666666307295e-1);
+    pc = 1.0 - 0.5*z + z*z*(((((-1.13585365213876817300e-11*z + 2.08757008419747316778e-9)*z
+      - 2.75573141792967388112e-7)*z + 2.48015872888517045348e-5)*z
+      - 1.38888888888730564116e-3)*z + 4.16666666666665929218e-2);
+
+    /* Quadrant q in {-2, -1, 0, 1, 2} (mod 4) */
+    ss = (q == 1.0 || q == -1.0) ? pc : ps;
+    cc = (q == 1.0 || q == -1.0) ? ps : pc;
+    s[l] = (q == 2.0 || q == -2.0 || q == -1.0) ? -ss : ss;
+    c[l] = (q == 2.0 || q == -2.0 || q == 1.0) ? -cc : cc;
+  }
+}
 
-  v[3] = -cf1*dif2*dy[0] - sum*sf1;
-  v[4] = -cf2*dif2*dy[1] - sum*sf2;
-  v[5] = -cf3*dif2*dy[2] - sum*sf3;
+/**
+ * Vectorized natural logarithm of positive, normal numbers (fdlibm kernel)
+ */
+static void vlog(const double *x, double *y, int n) {
+  const double ln2_hi = 6.93147180369123816490e-01;
+  const double ln2_lo = 1.90821492927058770002e-10;
+  uint64_t bits, ebits;
+  double e, m, f, s, z, w, R, hfsq;
+  int l;
+
+  for (l = 0; l < n; l++) {
+    memcpy(&bits, &x[l], sizeof(bits));
+
+    /* x = m*2^e, m in [1, 2) */
+    ebits = (bits >> 52) | 0x4330000000000000ULL;
+    memcpy(&e, &ebits, sizeof(e));
+    e = e - 4503599627370496.0 - 1023.0;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    memcpy(&m, &bits, sizeof(m));
+
+    /* m in [sqrt(2)/2, sqrt(2)) */
+    e = (m > 1.41421356237309504880) ? e + 1.0 : e;
+    m = (m > 1.41421356237309504880) ? 0.5*m : m;
+
+    f = m - 1.0;
+    s = f/(2.0 + f);
+    z = s*s;
+    w = z*z;
+    R = z*(6.666666666666735130e-01 + w*(2.857142874366239149e-01 + w*(1.818357216161805012e-01
+      + w*1.479819860511658591e-01))) + w*(3.999999999940941908e-01
+      + w*(2.222219843214978396e-01 + w*1.531383769920937332e-01));
+    hfsq = 0.5*f*f;
+
+    y[l] = e*ln2_hi - ((hfsq - (s*(hfsq + R) + e*ln2_lo)) - f);
+  }
+}
+
+/**
+ * Evaluates the sin/cos of the angles, unless the angles did not change since the last call
+ */
+static void trig(lanes *w, int nl) {
+  int i;
 
+  if (w->trig) return;
+  for (i = 0; i < 3; i++) vsincos(w->xv[i], w->sf[i], w->cf[i], nl);
+  w->trig = 1;
 }
 
 /**
- * The energy integral
+ * The drift: the flow of the unperturbed part of the Hamiltonian over time h
  */
-double energy(double *y, double eps) {
-  double I1, I2, I3, f1, f2, f3, cf1, cf2, cf3, dif, en;
+static void drift(lanes *w, int nl, double h) {
+  int l;
 
-  f1   = y[0];
-  f2   = y[1];
-  f3   = y[2];
-  I1   = y[3];
-  I2   = y[4];
-  I3   = y[5];
+  w->trig = 0;
 
-  cf1  = cos(f1);
-  cf2  = cos(f2);
-  cf3  = cos(f3);
+  for (l = 0; l < nl; l++) {
+    w->xv[0][l] = w->xv[0][l] + w->xv[3][l]*h;
+    w->xv[1][l] = w->xv[1][l] + w->xv[4][l]*h;
+    w->xv[2][l] = w->xv[2][l] + 1.0*h;
 
-  dif  = eps/(cf1 + cf2 + cf3 + 4);
-  en   = I1*I1/2.0 + I2*I2/2.0 + I3 + dif;
+    w->dy[0][l] = w->dy[0][l] + w->dy[3][l]*h;
+    w->dy[1][l] = w->dy[1][l] + w->dy[4][l]*h;
+  }
+}
 
-  return en;
+/**
+ * The drift of the rotation mode: the sin/cos of the angles are advanced by the rotor r
+ * of the drift time h
+ */
+static void rotate(lanes *w, int nl, int r, double h) {
+  double c, s;
+  int i, l;
+
+  drift(w, nl, h);
+  w->trig = 1;
+
+  for (i = 0; i < 2; i++) {
+    for (l = 0; l < nl; l++) {
+      c = w->cf[i][l]*w->rc[r][i][l] - w->sf[i][l]*w->rs[r][i][l];
+      s = w->sf[i][l]*w->rc[r][i][l] + w->cf[i][l]*w->rs[r][i][l];
+      w->cf[i][l] = c;
+      w->sf[i][l] = s;
+    }
+  }
+
+  for (l = 0; l < nl; l++) {
+    c = w->cf[2][l]*w->c3[r] - w->sf[2][l]*w->s3[r];
+    s = w->sf[2][l]*w->c3[r] + w->cf[2][l]*w->s3[r];
+    w->cf[2][l] = c;
+    w->sf[2][l] = s;
+  }
 }
 
 /**
- * The variational integral
+ * Updates the rotors of the first two angles after the kick changed the actions by di.
+ * The rotation angles di*h are small, so the truncated series are exact to the rounding
  */
-double variat(double *xv, double *dy, double eps) {
-  double acc[6], var[6], vint;
+static void spin(lanes *w, int nl) {
+  double x, x2, ec, es, c, s;
+  int r, i, l;
+
+  for (r = 0; r < w->nr; r++) {
+    for (i = 0; i < 2; i++) {
+      for (l = 0; l < nl; l++) {
+        x = w->di[i][l]*w->hr[r];
+        x2 = x*x;
+        ec = 1.0 - x2*(0.5 - x2/24.0);
+        es = x*(1.0 - x2*(1.0/6.0 - x2/120.0));
+        c = w->rc[r][i][l]*ec - w->rs[r][i][l]*es;
+        s = w->rs[r][i][l]*ec + w->rc[r][i][l]*es;
+        w->rc[r][i][l] = c;
+        w->rs[r][i][l] = s;
+      }
+    }
+  }
+}
 
-  vinteraction(xv, acc, dy, var, eps);
+/**
+ * Restores the unit length of the sin/cos pairs and the rotors of the lanes in mask
+ * (one Newton step)
+ */
+static void renormalize(lanes *w, int nl, const int *mask) {
+  double f;
+  int r, i, l;
+
+  for (i = 0; i < 3; i++) {
+    for (l = 0; l < nl; l++) {
+      f = mask[l] ? 1.5 - 0.5*(w->cf[i][l]*w->cf[i][l] + w->sf[i][l]*w->sf[i][l]) : 1.0;
+      w->cf[i][l] *= f;
+      w->sf[i][l] *= f;
+    }
+  }
 
-  vint = -acc[3]*dy[0] -acc[4]*dy[1] -acc[5]*dy[2] +
-         +acc[0]*dy[3] +acc[1]*dy[4] +acc[2]*dy[5];
+  for (r = 0; r < w->nr; r++) {
+    for (i = 0; i < 2; i++) {
+      for (l = 0; l < nl; l++) {
+        f = mask[l] ? 1.5 - 0.5*(w->rc[r][i][l]*w->rc[r][i][l] + w->rs[r][i][l]*w->rs[r][i][l])
+          : 1.0;
+        w->rc[r][i][l] *= f;
+        w->rs[r][i][l] *= f;
+      }
+    }
+  }
+}
 
-  return vint;
+/**
+ * Evaluates the sin/cos of the angles and the rotors of the lanes in mask exactly. The other
+ * lanes keep their rotated values, so that the rotation error of an orbit does not depend on
+ * the orbits that share the lane block
+ */
+static void rotors(lanes *w, int nl, const int *mask) {
+  double s[AWEB_LANES], c[AWEB_LANES];
+  int r, i, l;
+
+  for (i = 0; i < 3; i++) {
+    vsincos(w->xv[i], s, c, nl);
+    for (l = 0; l < nl; l++) {
+      w->sf[i][l] = mask[l] ? s[l] : w->sf[i][l];
+      w->cf[i][l] = mask[l] ? c[l] : w->cf[i][l];
+    }
+  }
+  w->trig = 1;
+
+  for (r = 0; r < w->nr; r++) {
+    for (i = 0; i < 2; i++) {
+      for (l = 0; l < nl; l++) w->tmp[l] = w->xv[3+i][l]*w->hr[r];
+      vsincos(w->tmp, s, c, nl);
+      for (l = 0; l < nl; l++) {
+        w->rs[r][i][l] = mask[l] ? s[l] : w->rs[r][i][l];
+        w->rc[r][i][l] = mask[l] ? c[l] : w->rc[r][i][l];
+      }
+    }
+  }
 }
 
 /**
- * Normalizes the variational vector (flag = 1)
+ * Prepares the rotation mode for the integrator: one rotor per distinct drift
  */
-double norm(int dim, double *a, int flag) {
-  double tmp = 0.0;
-  int i;
+static void rotors_init(lanes *w, const double *drifts, int n, double step) {
+  int j, r;
 
-  for (i=1; i<=dim; i++) tmp += a[i]*a[i];
-  tmp = sqrt(tmp);
-  if (flag) for (i=1; i<=dim; i++) a[i]= a[i]/tmp;
+  w->rot = 1;
+  w->nr = 0;
 
-  return tmp;
+  for (j = 0; j < n; j++) {
+    w->map[j] = -1;
+    if (drifts[j] == 0.0) continue;
+    for (r = 0; r < w->nr; r++) {
+      if (w->hr[r] == drifts[j]*step) w->map[j] = r;
+    }
+    if (w->map[j] < 0) {
+      r = w->nr++;
+      w->hr[r] = drifts[j]*step;
+      w->c3[r] = cos(w->hr[r]);
+      w->s3[r] = sin(w->hr[r]);
+      w->map[j] = r;
+    }
+  }
 }
 
 /**
- * Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008)
- * with the modified Leapfrog integrator SABA2 (Laskar & Robutel, CMDA, 2001)
+ * The kick: the right hand sides + variational equations of the Hamiltonian model of the
+ * Arnold web, see Froeschle+ Science 289 (2000), applied over time h
  */
-double smegno2(double *xv0, double step, double tend, double eps, double *err) {
-  double c1, c2, d1;
-  double Y0, mY0, Y1, mY1, maxe;
-  double acc[6], dy[6], var[6], xv[6], t, en, en0, h, delta, delta0;
-  long int ks;
-  int i, checkout;
-  //double v0;
-
-  c1    = 0.5-sqrt(3.0)/10.0;
-  c2    = sqrt(3.0)/3.0;
-  d1    = 0.5;
-
-  t     = 0.0;
-  maxe  = 0.0;
-  checkout = 1000;
-  Y0    = mY0   = Y1    = mY1   = 0.0;
+static void vinteraction(lanes *w, int nl, double h, double eps) {
+  double sf1, sf2, sf3, cf1, cf2, cf3, dif, dif2, dif3, sum;
+  int l;
+
+  w->kicks++;
+  trig(w, nl);
+
+  for (l = 0; l < nl; l++) {
+    sf1  = w->sf[0][l];
+    sf2  = w->sf[1][l];
+    sf3  = w->sf[2][l];
+    cf1  = w->cf[0][l];
+    cf2  = w->cf[1][l];
+    cf3  = w->cf[2][l];
+
+    dif  = cf1 + cf2 + cf3 + 4;
+    dif2 = eps/(dif*dif);
+    dif3 = dif2/dif;
+
+    // variational equations
+    sum  = 2*(sf1*w->dy[0][l] + sf2*w->dy[1][l] + sf3*w->dy[2][l])*dif3;
+
+    w->dy[3][l] = w->dy[3][l] + (-cf1*dif2*w->dy[0][l] - sum*sf1)*h;
+    w->dy[4][l] = w->dy[4][l] + (-cf2*dif2*w->dy[1][l] - sum*sf2)*h;
+    w->dy[5][l] = w->dy[5][l] + (-cf3*dif2*w->dy[2][l] - sum*sf3)*h;
+
+    // right hand sides
+    w->di[0][l] = -sf1*dif2*h;
+    w->di[1][l] = -sf2*dif2*h;
+    w->xv[3][l] = w->xv[3][l] + w->di[0][l];
+    w->xv[4][l] = w->xv[4][l] + w->di[1][l];
+    w->xv[5][l] = w->xv[5][l] - sf3*dif2*h;
+  }
+
+  if (w->rot) spin(w, nl);
+}
+
+/**
+ * The energy integral
+ */
+static void energy(lanes *w, int nl, double eps, double *en) {
+  int l;
+
+  trig(w, nl);
+
+  for (l = 0; l < nl; l++) {
+    en[l] = w->xv[3][l]*w->xv[3][l]/2.0 + w->xv[4][l]*w->xv[4][l]/2.0 + w->xv[5][l]
+      + eps/(w->cf[0][l] + w->cf[1][l] + w->cf[2][l] + 4);
+  }
+}
+
+/**
+ * The squared norm of the variational vector
+ */
+static void norm(lanes *w, int nl, double *delta) {
+  int i, l;
+
+  for (l = 0; l < nl; l++) delta[l] = 0.0;
+  for (i = 0; i < 6; i++) {
+    for (l = 0; l < nl; l++) delta[l] += w->dy[i][l]*w->dy[i][l];
+  }
+}
+
+/**
+ * The corrector: the kick of the Hamiltonian {{A,B},B} = V_1^2 + V_2^2 over time h, where
+ * A is the unperturbed part and V = eps/(cos(f1)+cos(f2)+cos(f3)+4) is the perturbation
+ * (the third action enters A linearly). The tangent vector follows its Hessian
+ */
+static void corrector(lanes *w, int nl, double h, double eps) {
+  double s0, s1, s2, c0, c1, c2, dif, q2, q3, q4, v0, v1, u0, u1, P;
+  double a00, a11, a01, a02, a12, h00, h11, h22, h01, h02, h12, g0, g1, g2;
+  int l;
+
+  trig(w, nl);
+
+  for (l = 0; l < nl; l++) {
+    s0 = w->sf[0][l];
+    s1 = w->sf[1][l];
+    s2 = w->sf[2][l];
+    c0 = w->cf[0][l];
+    c1 = w->cf[1][l];
+    c2 = w->cf[2][l];
+
+    dif = c0 + c1 + c2 + 4;
+    q2 = eps/(dif*dif);
+    q3 = q2/dif;
+    q4 = q3/dif;
+
+    /* The first and the second derivatives of V */
+    v0 = q2*s0;
+    v1 = q2*s1;
+    a00 = c0*q2 + 2*s0*s0*q3;
+    a11 = c1*q2 + 2*s1*s1*q3;
+    a01 = 2*s0*s1*q3;
+    a02 = 2*s0*s2*q3;
+    a12 = 2*s1*s2*q3;
+
+    /* The gradient and the Hessian of V_1^2 + V_2^2 */
+    g0 = 2*(v0*a00 + v1*a01);
+    g1 = 2*(v0*a01 + v1*a11);
+    g2 = 2*(v0*a02 + v1*a12);
+
+    u0 = v0*c0;
+    u1 = v1*c1;
+    P = v0*s0 + v1*s1;
+
+    h00 = 2*(a00*a00 + a01*a01 + 6*q4*s0*s0*P + 2*q3*(2*u0*s0 + c0*P) - v0*s0*q2);
+    h11 = 2*(a01*a01 + a11*a11 + 6*q4*s1*s1*P + 2*q3*(2*u1*s1 + c1*P) - v1*s1*q2);
+    h22 = 2*(a02*a02 + a12*a12 + 6*q4*s2*s2*P + 2*q3*c2*P);
+    h01 = 2*(a00*a01 + a01*a11 + 6*q4*s0*s1*P + 2*q3*(u0*s1 + u1*s0));
+    h02 = 2*(a00*a02 + a01*a12 + 6*q4*s0*s2*P + 2*q3*u0*s2);
+    h12 = 2*(a01*a02 + a11*a12 + 6*q4*s1*s2*P + 2*q3*u1*s2);
+
+    w->dy[3][l] = w->dy[3][l] - (h00*w->dy[0][l] + h01*w->dy[1][l] + h02*w->dy[2][l])*h;
+    w->dy[4][l] = w->dy[4][l] - (h01*w->dy[0][l] + h11*w->dy[1][l] + h12*w->dy[2][l])*h;
+    w->dy[5][l] = w->dy[5][l] - (h02*w->dy[0][l] + h12*w->dy[1][l] + h22*w->dy[2][l])*h;
+
+    w->di[0][l] = -g0*h;
+    w->di[1][l] = -g1*h;
+    w->xv[3][l] = w->xv[3][l] + w->di[0][l];
+    w->xv[4][l] = w->xv[4][l] + w->di[1][l];
+    w->xv[5][l] = w->xv[5][l] - g2*h;
+  }
+
+  if (w->rot) spin(w, nl);
+}
+
+/**
+ * The symplectic integrator: the drifts and the kicks (fractions of the step) applied
+ * alternately, drift[0], kick[0], ..., kick[kicks-1], drift[kicks], and the coefficient of
+ * the corrector, g = 0 when there is none
+ */
+typedef struct {
+  int kicks;
+  double drift[STAGES+1];
+  double kick[STAGES];
+  double g;
+} scheme;
+
+/**
+ * The integrators by the driver: SABAn and SBABn (Laskar & Robutel, CMDA, 2001) and the
+ * 4th order integrator of Yoshida (Phys. Lett. A, 1990)
+ */
+static const scheme schemes[] = {
+  {2, {0.21132486540518713, 0.5773502691896257, 0.21132486540518713},
+    {0.5, 0.5}, 0.01116454968463011},
+  {3, {0.1127016653792583, 0.3872983346207417, 0.3872983346207417, 0.1127016653792583},
+    {5.0/18.0, 4.0/9.0, 5.0/18.0}, 0.005634593363122809},
+  {4, {0.06943184420297371, 0.2605776340045981, 0.33998104358485626, 0.2605776340045981,
+    0.06943184420297371},
+    {0.17392742256872692, 0.32607257743127305, 0.32607257743127305, 0.17392742256872692},
+    0.003396775048208601},
+  {3, {0.0, 0.5, 0.5, 0.0},
+    {1.0/6.0, 2.0/3.0, 1.0/6.0}, 1.0/72.0},
+  {4, {0.0, 0.276393202250021, 0.447213595499958, 0.276393202250021, 0.0},
+    {1.0/12.0, 5.0/12.0, 5.0/12.0, 1.0/12.0}, 0.006318264279517538},
+  {5, {0.0, 0.17267316464601146, 0.32732683535398854, 0.32732683535398854,
+    0.17267316464601146, 0.0},
+    {1.0/20.0, 49.0/180.0, 16.0/45.0, 49.0/180.0, 1.0/20.0}, 0.003644793600153249},
+  {3, {0.6756035959798289, -0.17560359597982877, -0.17560359597982877, 0.6756035959798289},
+    {1.3512071919596578, -1.7024143839193153, 1.3512071919596578}, 0.0}
+};
+
+/**
+ * One step of the integrator, with the corrector applied on both sides
+ */
+static void integrate(lanes *w, int nl, const scheme *m, int corr, double step, double eps) {
+  double hc = -0.5*m->g*step*step*step;
+  int j;
+
+  if (corr && m->g != 0.0) corrector(w, nl, hc, eps);
+
+  for (j = 0; j <= m->kicks; j++) {
+    if (m->drift[j] != 0.0) {
+      if (w->rot) {
+        rotate(w, nl, w->map[j], m->drift[j]*step);
+      } else {
+        drift(w, nl, m->drift[j]*step);
+      }
+    }
+    if (j < m->kicks) vinteraction(w, nl, m->kick[j]*step, eps);
+  }
+
+  if (corr && m->g != 0.0) corrector(w, nl, hc, eps);
+}
+
+/**
+ * The SplitMix64 mixing function (Steele, Lea & Flood, OOPSLA 2014)
+ */
+static uint64_t splitmix64(uint64_t x) {
+  x = x + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * Loads the initial condition k into the lane l and sets its tangent vector.
+ *
+ * The tangent vector is drawn from a counter-based generator keyed by the key and the
+ * initial condition itself, so that it does not depend on the batch, the thread or
+ * the order in which the initial conditions are integrated
+ */
+static void lane_load(lanes *w, int l, double **xv, int k, uint64_t key) {
+  double delta;
+  uint64_t h, bits;
+  int i;
 
   /* Initialize state vector */
-  for (i=0; i<=6; i++) xv[i] = xv0[i];
+  w->trig = 0;
+  h = key;
+  for (i = 0; i < 6; i++) {
+    w->xv[i][l] = xv[i][k];
+    memcpy(&bits, &xv[i][k], sizeof(bits));
+    h = splitmix64(h ^ bits);
+  }
 
-  /* Set the tangent vector */
-  for (i=0; i<=6; i++) dy[i] = rand()/(RAND_MAX+1.0);
+  /* Set the tangent vector, uniform in [0, 1) */
+  for (i = 0; i < 6; i++) w->dy[i][l] = (splitmix64(h + i) >> 11)*(1.0/9007199254740992.0);
 
   /* Normalize the tangent vector */
-  delta0= norm(6, dy, 1);
-  en0   = energy(xv, eps);
-  //v0    = variat(xv, dy, eps);
-
-  /* SABA2 integrator + variations */
-
-  ks    = 0;
-
-  while (t <= tend) {
-
-    /* 1st drift */
-    h     = c1*step;
-    xv[0] = xv[0] + xv[3]*h;
-    xv[1] = xv[1] + xv[4]*h;
-    xv[2] = xv[2] + 1.0*h;
-
-    dy[0] = dy[0] + dy[3]*h;
-    dy[1] = dy[1] + dy[4]*h;
-    dy[2] = dy[2];
-
-    /* 1st kick */
-    vinteraction(xv, acc, dy, var, eps);
-    h     = d1*step;
-    xv[3] = xv[3] + acc[3]*h;
-    xv[4] = xv[4] + acc[4]*h;
-    xv[5] = xv[5] + acc[5]*h;
-
-    dy[3] = dy[3] + var[3]*h;
-    dy[4] = dy[4] + var[4]*h;
-    dy[5] = dy[5] + var[5]*h;
-
-    /* 2nd drift */
-    h     = c2*step;
-    xv[0] = xv[0] + xv[3]*h;
-    xv[1] = xv[1] + xv[4]*h;
-    xv[2] = xv[2] + 1.0*h;
-
-    dy[0] = dy[0] + dy[3]*h;
-    dy[1] = dy[1] + dy[4]*h;
-    dy[2] = dy[2];
-
-    ks++;
-    t = ks*step;
-
-    /* MEGNO */
-    delta   = norm(6, dy, 0);
-    Y1      =  Y0*((double)ks-1.0)/((double)ks) + 2.0*log(delta/delta0);
-    mY1     = mY0*((double)ks-1.0)/((double)ks) + Y1/((double)ks);
-    Y0      = Y1;
-    mY0     = mY1;
-    delta0  = delta;
-
-    /* relative errors of the energy and the variational integrator */
-    if (ks%checkout == 0) {
-      en = fabs((energy(xv,eps)-en0)/en0);
-      if (en>maxe) maxe = en;
+  delta = 0.0;
+  for (i = 0; i < 6; i++) delta += w->dy[i][l]*w->dy[i][l];
+  delta = sqrt(delta);
+  for (i = 0; i < 6; i++) w->dy[i][l] = w->dy[i][l]/delta;
+}
+
+/**
+ * Saves the orbit of the lane l to its serialized state s
+ */
+static void lane_save(lanes *w, int l, double *s) {
+  int r, i;
+
+  for (i = 0; i < 6; i++) {
+    s[AWEB_STATE_XV + i] = w->xv[i][l];
+    s[AWEB_STATE_DY + i] = w->dy[i][l];
+  }
+
+  /* The rotation mode: the rotated sin/cos, so that the resumed orbit is not resynced */
+  if (!w->rot) return;
+  for (i = 0; i < 3; i++) {
+    s[AWEB_STATE_SF + i] = w->sf[i][l];
+    s[AWEB_STATE_CF + i] = w->cf[i][l];
+  }
+  for (r = 0; r < w->nr; r++) {
+    for (i = 0; i < 2; i++) {
+      s[AWEB_STATE_ROT + 4*r + 2*i] = w->rc[r][i][l];
+      s[AWEB_STATE_ROT + 4*r + 2*i + 1] = w->rs[r][i][l];
     }
   }
+}
+
+/**
+ * Restores the orbit of the lane l from its serialized state s
+ */
+static void lane_restore(lanes *w, int l, const double *s) {
+  int r, i;
+
+  w->trig = 0;
+  for (i = 0; i < 6; i++) {
+    w->xv[i][l] = s[AWEB_STATE_XV + i];
+    w->dy[i][l] = s[AWEB_STATE_DY + i];
+  }
 
-  *err = maxe;
-  return mY1;
+  if (!w->rot) return;
+  for (i = 0; i < 3; i++) {
+    w->sf[i][l] = s[AWEB_STATE_SF + i];
+    w->cf[i][l] = s[AWEB_STATE_CF + i];
+  }
+  for (r = 0; r < w->nr; r++) {
+    for (i = 0; i < 2; i++) {
+      w->rc[r][i][l] = s[AWEB_STATE_ROT + 4*r + 2*i];
+      w->rs[r][i][l] = s[AWEB_STATE_ROT + 4*r + 2*i + 1];
+    }
+  }
 }
 
 /**
- * Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008)
- * with the modified Leapfrog integrator SABA2 (Laskar & Robutel, CMDA, 2001)
+ * Takes the index of the next initial condition to integrate (shared by the threads)
  */
-double smegno3(double *xv0, double step, double tend, double eps,  double *err) {
-  double c1, c2, d1, d2;
-  double Y0, mY0, Y1, mY1, maxe;
-  double acc[6], dy[6], var[6], xv[6], t, en, en0, h, delta, delta0;
-  long int ks;
-  int i, checkout;
-  //double v0;
-
-  // SABA3 coefficients
-  c1    = 0.5 - sqrt(15.0)/10.0;
-  c2    = sqrt(15.0)/10.0;
-  d1    = 5.0/18.0;
-  d2    = 4.0/9.0;
-
-  t     = 0.0;
-  maxe  = 0.0;
-  checkout = 1000;
-  Y0    = mY0   = Y1    = mY1   = 0.0;
+static int lane_fetch(int *next) {
+  int k;
 
-  /* Initialize state vector */
-  for (i=0; i<=6; i++) xv[i] = xv0[i];
-
-  /* Set the tangent vector */
-  for (i=0; i<=6; i++) dy[i] = rand()/(RAND_MAX+1.0);
-
-  /* Randomize the tangent vector */
-  delta0= norm(6, dy, 1);
-
-  en0   = energy(xv, eps);
-  //v0    = variat(xv, dy, eps);
-
-  /* SABA3 integrator + variations */
-  ks    = 0;
-
-  while (t <= tend) {
-
-    // 1st drift
-    h     = c1*step;
-    xv[0] = xv[0] + xv[3]*h;
-    xv[1] = xv[1] + xv[4]*h;
-    xv[2] = xv[2] + 1.0*h;
-
-    dy[0] = dy[0] + dy[3]*h;
-    dy[1] = dy[1] + dy[4]*h;
-    dy[2] = dy[2];
-
-    // 1st kick
-    vinteraction(xv, acc, dy, var, eps);
-    h     = d1*step;
-    xv[3] = xv[3] + acc[3]*h;
-    xv[4] = xv[4] + acc[4]*h;
-    xv[5] = xv[5] + acc[5]*h;
-
-    dy[3] = dy[3] + var[3]*h;
-    dy[4] = dy[4] + var[4]*h;
-    dy[5] = dy[5] + var[5]*h;
-
-    // 2nd drift
-    h     = c2*step;
-    xv[0] = xv[0] + xv[3]*h;
-    xv[1] = xv[1] + xv[4]*h;
-    xv[2] = xv[2] + 1.0*h;
-
-    dy[0] = dy[0] + dy[3]*h;
-    dy[1] = dy[1] + dy[4]*h;
-    dy[2] = dy[2];
-
-    // 2nd kick
-    vinteraction(xv, acc, dy, var, eps);
-    h     = d2*step;
-    xv[3] = xv[3] + acc[3]*h;
-    xv[4] = xv[4] + acc[4]*h;
-    xv[5] = xv[5] + acc[5]*h;
-
-    dy[3] = dy[3] + var[3]*h;
-    dy[4] = dy[4] + var[4]*h;
-    dy[5] = dy[5] + var[5]*h;
-
-    // 3rd drift
-    h     = c2*step;
-    xv[0] = xv[0] + xv[3]*h;
-    xv[1] = xv[1] + xv[4]*h;
-    xv[2] = xv[2] + 1.0*h;
-
-    dy[0] = dy[0] + dy[3]*h;
-    dy[1] = dy[1] + dy[4]*h;
-    dy[2] = dy[2];
-
-    // 3rd kick
-    vinteraction(xv, acc, dy, var, eps);
-    h     = d1*step;
-    xv[3] = xv[3] + acc[3]*h;
-    xv[4] = xv[4] + acc[4]*h;
-    xv[5] = xv[5] + acc[5]*h;
-
-    dy[3] = dy[3] + var[3]*h;
-    dy[4] = dy[4] + var[4]*h;
-    dy[5] = dy[5] + var[5]*h;
-
-    // final drift
-    h     = c1*step;
-    xv[0] = xv[0] + xv[3]*h;
-    xv[1] = xv[1] + xv[4]*h;
-    xv[2] = xv[2] + 1.0*h;
-
-    dy[0] = dy[0] + dy[3]*h;
-    dy[1] = dy[1] + dy[4]*h;
-    dy[2] = dy[2];
-
-    ks++;
-    t = ks*step;
-
-    /* MEGNO */
-    delta   = norm(6, dy, 0);
-    Y1      =  Y0*((double)ks-1.0)/((double)ks) + 2.0*log(delta/delta0);
-    mY1     = mY0*((double)ks-1.0)/((double)ks) + Y1/((double)ks);
-    Y0      = Y1;
-    mY0     = mY1;
-    delta0  = delta;
-
-    // relative errors of the energy and the variational integrator
-    if (ks%checkout == 0) {
-      en = fabs((energy(xv,eps)-en0)/en0);
-      if (en>maxe) maxe = en;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+  k = (*next)++;
+
+  return k;
+}
+
+/**
+ * Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008) of the lane block.
+ *
+ * Up to AWEB_LANES initial conditions are advanced together; a lane that reaches tend, or
+ * whose orbit has been classified (conv != NULL), is refilled with the next initial condition.
+ *
+ * The MEGNO is sampled every in->stride steps, and the lanes finish and are refilled at the
+ * samples only. The energy of an orbit is checked every in->checkout of its own steps. The
+ * instrumentation (in->cnt) reads the clock once per refill, not in the steps.
+ *
+ * With in->state, the orbits are loaded from and saved to their serialized states. With
+ * in->slice > 0 an orbit is paused after the slice of the integration time, and continues
+ * from its state in the next call; the finished orbits are not integrated again. A resumed
+ * orbit follows the same samples and checks as in a single call.
+ *
+ * With in->series > 0 the <Y> and the relative energy error are recorded at the first sample
+ * past each of in->times. The points past the end of the orbit are not written
+ */
+static void smegno_lanes(const integrator *in, int n, double **xv, int *next,
+    double *megno, double *err, double *tstop) {
+  const scheme *m;
+  const convergence *conv = in->conv;
+  double step = in->step, tend = in->tend, eps = in->eps;
+  lanes w;
+  double Y[AWEB_LANES], mY[AWEB_LANES], maxe[AWEB_LANES], ks[AWEB_LANES], since[AWEB_LANES];
+  double delta[AWEB_LANES], delta0[AWEB_LANES], en[AWEB_LANES], en0[AWEB_LANES];
+  double ns[AWEB_LANES], f[AWEB_LANES], t0[AWEB_LANES], k0[AWEB_LANES], tp[AWEB_LANES];
+  double tnext[AWEB_LANES], *s;
+  int stop[AWEB_LANES], fin[AWEB_LANES], idx[AWEB_LANES], fresh[AWEB_LANES], due[AWEB_LANES];
+  int si[AWEB_LANES], sync[AWEB_LANES], ren[AWEB_LANES], series, rec;
+  double t, inv, now = 0.0;
+  long int steps, check, renorm, nextc[AWEB_LANES], nextr[AWEB_LANES];
+  int i, l, k, nl, active, done, checkout, stride, sample, big;
+
+  checkout = (in->checkout > 0) ? in->checkout : 1000;
+  stride = (in->stride > 0) ? in->stride : 1;
+  series = (in->ts && in->times) ? in->series : 0;
+
+  m = &schemes[0];
+  if (in->driver > 0 && in->driver <= (int) (sizeof(schemes)/sizeof(schemes[0]))) {
+    m = &schemes[in->driver - 1];
+  }
+
+  nl = (n < AWEB_LANES) ? n : AWEB_LANES;
+  active = nl;
+  done = 1;
+
+  /* Lanes that never get an initial condition integrate zeros */
+  memset(&w, 0, sizeof(w));
+  if (in->rotate) rotors_init(&w, m->drift, m->kicks + 1, step);
+  for (l = 0; l < nl; l++) idx[l] = -1;
+
+  steps = 0;
+  check = renorm = LONG_MAX;
+  sample = stride;
+
+  while (active > 0) {
+
+    /* Store the finished lanes and refill them with the next initial conditions */
+    if (done) {
+      if (in->cnt) now = TICKS();
+      active = 0;
+      for (l = 0; l < nl; l++) {
+        fresh[l] = sync[l] = 0;
+
+        if (idx[l] >= 0 && (fin[l] || ks[l]*step >= tp[l])) {
+          k = idx[l];
+          megno[k] = mY[l];
+          err[k] = maxe[l];
+          if (tstop) tstop[k] = ks[l]*step;
+          if (in->cnt) {
+            in->cnt->ticks[k] = now - t0[l];
+            in->cnt->steps[k] = ks[l];
+            in->cnt->kicks[k] = (double) w.kicks - k0[l];
+          }
+          if (in->state) {
+            s = in->state + (size_t) k*AWEB_STATE;
+            lane_save(&w, l, s);
+            s[AWEB_STATE_Y] = Y[l];
+            s[AWEB_STATE_MY] = mY[l];
+            s[AWEB_STATE_DELTA0] = delta0[l];
+            s[AWEB_STATE_KS] = ks[l];
+            s[AWEB_STATE_NS] = ns[l];
+            s[AWEB_STATE_MAXE] = maxe[l];
+            s[AWEB_STATE_EN0] = en0[l];
+            s[AWEB_STATE_SINCE] = since[l];
+            s[AWEB_STATE_TICKS] = now - t0[l];
+            s[AWEB_STATE_KICKS] = (double) w.kicks - k0[l];
+            s[AWEB_STATE_STOP] = stop[l];
+            s[AWEB_STATE_SERIES] = si[l];
+            s[AWEB_STATE_STATUS] = fin[l] ? AWEB_FINISHED : AWEB_PAUSED;
+          }
+          idx[l] = -1;
+        }
+
+        while (idx[l] < 0 && (k = lane_fetch(next)) < n) {
+          s = in->state ? in->state + (size_t) k*AWEB_STATE : NULL;
+
+          /* Finished in a previous call, return the stored results */
+          if (s && s[AWEB_STATE_STATUS] == AWEB_FINISHED) {
+            megno[k] = s[AWEB_STATE_MY];
+            err[k] = s[AWEB_STATE_MAXE];
+            if (tstop) tstop[k] = s[AWEB_STATE_KS]*step;
+            if (in->cnt) {
+              in->cnt->ticks[k] = s[AWEB_STATE_TICKS];
+              in->cnt->steps[k] = s[AWEB_STATE_KS];
+              in->cnt->kicks[k] = s[AWEB_STATE_KICKS];
+            }
+            continue;
+          }
+
+          idx[l] = k;
+          stop[l] = fin[l] = 0;
+          t0[l] = now;
+          k0[l] = (double) w.kicks;
+
+          if (s && s[AWEB_STATE_STATUS] == AWEB_PAUSED) {
+            lane_restore(&w, l, s);
+            Y[l] = s[AWEB_STATE_Y];
+            mY[l] = s[AWEB_STATE_MY];
+            delta0[l] = s[AWEB_STATE_DELTA0];
+            ks[l] = s[AWEB_STATE_KS];
+            ns[l] = s[AWEB_STATE_NS];
+            maxe[l] = s[AWEB_STATE_MAXE];
+            en0[l] = s[AWEB_STATE_EN0];
+            since[l] = s[AWEB_STATE_SINCE];
+            stop[l] = (int) s[AWEB_STATE_STOP];
+            si[l] = (int) s[AWEB_STATE_SERIES];
+            t0[l] = now - s[AWEB_STATE_TICKS];
+            k0[l] = (double) w.kicks - s[AWEB_STATE_KICKS];
+            fresh[l] = sync[l] = 0;
+          } else {
+            lane_load(&w, l, xv, k, in->key);
+            Y[l] = mY[l] = maxe[l] = ks[l] = ns[l] = 0.0;
+            delta0[l] = 1.0;
+            since[l] = -1.0;
+            si[l] = 0;
+            fresh[l] = sync[l] = 1;
+          }
+
+          tnext[l] = (si[l] < series) ? in->times[si[l]] : HUGE_VAL;
+
+          tp[l] = (in->slice > 0.0 && s) ? ks[l]*step + in->slice : HUGE_VAL;
+          nextc[l] = steps + checkout - ((long int) ks[l])%checkout;
+          nextr[l] = steps + RENORM - ((long int) ks[l])%RENORM;
+        }
+
+        if (idx[l] >= 0) active++;
+      }
+
+      check = renorm = LONG_MAX;
+      for (l = 0; l < nl; l++) {
+        if (idx[l] >= 0 && nextc[l] < check) check = nextc[l];
+        if (idx[l] >= 0 && nextr[l] < renorm) renorm = nextr[l];
+      }
+
+      if (active == 0) break;
+
+      /* The rotation mode: exact sin/cos of the new orbits, the resumed ones keep theirs */
+      if (w.rot) rotors(&w, nl, sync);
+      energy(&w, nl, eps, en);
+      for (l = 0; l < nl; l++) {
+        if (fresh[l]) en0[l] = en[l];
+      }
+
+      done = 0;
+    }
+
+    integrate(&w, nl, m, in->corrector, step, eps);
+
+    steps++;
+
+    /* MEGNO: <Y> of the samples, log(delta^2/delta0^2) = 2 log(delta/delta0) */
+    if (--sample == 0) {
+      sample = stride;
+
+      norm(&w, nl, delta);
+      for (l = 0; l < nl; l++) {
+        ks[l] = ks[l] + stride;
+        w.tmp[l] = delta[l]/delta0[l];
+      }
+      vlog(w.tmp, w.tmp, nl);
+
+      big = 0;
+      for (l = 0; l < nl; l++) {
+        ns[l]     = ns[l] + 1.0;
+        inv       = 1.0/ns[l];
+        Y[l]      = Y[l] - Y[l]*inv + w.tmp[l];
+        mY[l]     = mY[l] + (Y[l] - mY[l])*inv;
+
+        /* Keep the tangent vector of chaotic orbits away from the overflow */
+        f[l]      = (delta[l] > 1e100) ? 1e-50 : 1.0;
+        delta0[l] = delta[l]*f[l]*f[l];
+        big       = big | (delta[l] > 1e100);
+      }
+
+      if (big) {
+        for (i = 0; i < 6; i++) {
+          for (l = 0; l < nl; l++) w.dy[i][l] = w.dy[i][l]*f[l];
+        }
+      }
+
+      /* The time series, the energy is evaluated only when a lane passes its next point */
+      if (series) {
+        rec = 0;
+        for (l = 0; l < nl; l++) rec = rec | (idx[l] >= 0 && ks[l]*step >= tnext[l]);
+
+        if (rec) {
+          energy(&w, nl, eps, en);
+          for (l = 0; l < nl; l++) {
+            if (idx[l] < 0) continue;
+            while (si[l] < series && ks[l]*step >= in->times[si[l]]) {
+              s = in->ts + ((size_t) idx[l]*series + si[l])*2;
+              s[0] = mY[l];
+              s[1] = fabs((en[l]-en0[l])/en0[l]);
+              si[l]++;
+            }
+            tnext[l] = (si[l] < series) ? in->times[si[l]] : HUGE_VAL;
+          }
+        }
+      }
+
+      /* The orbits finish at the first sample after their classification or tend */
+      for (l = 0; l < nl; l++) {
+        if (idx[l] < 0) continue;
+        fin[l] = stop[l] || ks[l]*step > tend;
+        if (fin[l] || ks[l]*step >= tp[l]) done = 1;
+      }
+    }
+
+    /**
+     * The rotation mode: exact sin/cos at the energy checks of an orbit, renormalization
+     * every RENORM of its own steps in between
+     */
+    if (w.rot && (steps == check || steps == renorm)) {
+      renorm = LONG_MAX;
+      for (l = 0; l < nl; l++) {
+        sync[l] = (idx[l] >= 0 && nextc[l] == steps);
+        ren[l] = (idx[l] >= 0 && nextr[l] == steps && !sync[l]);
+        if (idx[l] >= 0 && nextr[l] == steps) nextr[l] += RENORM;
+        if (idx[l] >= 0 && nextr[l] < renorm) renorm = nextr[l];
+      }
+      if (steps == check) rotors(&w, nl, sync);
+      renormalize(&w, nl, ren);
+    }
+
+    /* relative errors of the energy and the variational integrator, of the lanes due */
+    if (steps == check) {
+      check = LONG_MAX;
+
+      energy(&w, nl, eps, en);
+      for (l = 0; l < nl; l++) {
+        due[l] = (idx[l] >= 0 && nextc[l] == steps);
+        if (!due[l]) continue;
+        en[l] = fabs((en[l]-en0[l])/en0[l]);
+        if (en[l] > maxe[l]) maxe[l] = en[l];
+        nextc[l] += checkout;
+      }
+      for (l = 0; l < nl; l++) {
+        if (idx[l] >= 0 && nextc[l] < check) check = nextc[l];
+      }
+
+      /**
+       * Early termination: the orbit is chaotic once <Y> exceeds conv->chaotic, and regular
+       * once |<Y>-2| < conv->regular has held over the second half of the integration
+       */
+      if (conv) {
+        for (l = 0; l < nl; l++) {
+          t = ks[l]*step;
+          if (!due[l] || t < conv->tmin) continue;
+          if (mY[l] > conv->chaotic) stop[l] = 1;
+          if (fabs(mY[l]-2.0) < conv->regular) {
+            if (since[l] < 0.0) since[l] = t;
+            if (since[l] <= 0.5*t) stop[l] = 1;
+          } else {
+            since[l] = -1.0;
+          }
+        }
+      }
     }
   }
+}
+
+/**
+ * The batched kernel: Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008).
+ *
+ * Integrates n initial conditions given in the struct-of-arrays layout, i.e. xv[0..5][0..n-1].
+ * When built with OpenMP, each thread runs its own lane block and takes the initial
+ * conditions from the shared queue. The results are reproducible for the given key and
+ * do not depend on the number of threads
+ */
+void smegnov(const integrator *in, int n, double **xv, double *megno, double *err,
+    double *tstop) {
+  int next = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel if (n > AWEB_LANES)
+#endif
+  smegno_lanes(in, n, xv, &next, megno, err, tstop);
+}
+
+/**
+ * The cell of the refined map: the rectangle of points [x0, x1] x [y0, y1]
+ */
+typedef struct {
+  int x0, x1, y0, y1;
+} cell;
+
+/**
+ * States of the points of the refined map
+ */
+#define POINT_EMPTY 0
+#define POINT_INTERPOLATED 1
+#define POINT_QUEUED 2
+#define POINT_COMPUTED 3
+
+/**
+ * Integrates the queued points of the map with one call of the batched kernel
+ */
+static void refine_compute(const integrator *in, double **xv, char *state, int *queue,
+    int nq, double **buf, double *megno, double *err, double *tstop) {
+  integrator iq = *in;
+  counters cq = {buf[9], buf[10], buf[11]};
+  double *xq[6];
+  int i, q;
+
+  if (nq == 0) return;
+
+  if (in->ts && in->series > 0) {
+    iq.ts = malloc((size_t) nq*2*in->series*sizeof(double));
+    if (!iq.ts) iq.series = 0;
+  }
+
+  /* The refined points are integrated to the end, they are not serialized */
+  iq.slice = 0.0;
+  iq.state = NULL;
+
+  for (i = 0; i < 6; i++) {
+    xq[i] = buf[i];
+    for (q = 0; q < nq; q++) xq[i][q] = xv[i][queue[q]];
+  }
+
+  if (in->cnt) iq.cnt = &cq;
+
+  smegnov(&iq, nq, xq, buf[6], buf[7], buf[8]);
 
-  *err = maxe;
-  return mY1;
+  for (q = 0; q < nq; q++) {
+    megno[queue[q]] = buf[6][q];
+    err[queue[q]] = buf[7][q];
+    if (tstop) tstop[queue[q]] = buf[8][q];
+    if (in->cnt) {
+      in->cnt->ticks[queue[q]] = cq.ticks[q];
+      in->cnt->steps[queue[q]] = cq.steps[q];
+      in->cnt->kicks[queue[q]] = cq.kicks[q];
+    }
+    if (iq.ts && iq.series > 0) {
+      memcpy(in->ts + (size_t) queue[q]*2*in->series, iq.ts + (size_t) q*2*in->series,
+          2*in->series*sizeof(double));
+    }
+    state[queue[q]] = POINT_COMPUTED;
+  }
+
+  if (in->ts && iq.ts != in->ts) free(iq.ts);
 }
 
+/**
+ * Fills the points of the cell that were not integrated by bilinear interpolation of
+ * its corners
+ */
+static void refine_fill(cell *c, int nx, char *state, double *f) {
+  double f00, f01, f10, f11, u, v;
+  int i, j, k;
+
+  f00 = f[c->y0*nx + c->x0];
+  f01 = f[c->y0*nx + c->x1];
+  f10 = f[c->y1*nx + c->x0];
+  f11 = f[c->y1*nx + c->x1];
+
+  for (j = c->y0; j <= c->y1; j++) {
+    for (i = c->x0; i <= c->x1; i++) {
+      k = j*nx + i;
+      if (state[k] == POINT_COMPUTED) continue;
+      u = (c->x1 > c->x0) ? (double)(i - c->x0)/(c->x1 - c->x0) : 0.0;
+      v = (c->y1 > c->y0) ? (double)(j - c->y0)/(c->y1 - c->y0) : 0.0;
+      f[k] = (1.0-v)*((1.0-u)*f00 + u*f01) + v*((1.0-u)*f10 + u*f11);
+    }
+  }
+}
+
+/**
+ * Queues the point (i, j) of the map for the integration
+ */
+static void refine_queue(int i, int j, int nx, char *state, int *queue, int *nq) {
+  int k = j*nx + i;
+
+  if (state[k] == POINT_COMPUTED || state[k] == POINT_QUEUED) return;
+  state[k] = POINT_QUEUED;
+  queue[(*nq)++] = k;
+}
+
+/**
+ * The adaptive (quadtree) MEGNO map of nx x ny points, xv[0..5][j*nx+i].
+ *
+ * The map is integrated on the coarse grid of the given stride first. Each cell whose corner
+ * MEGNO values differ by more than tol is split into four, and its new corners are
+ * integrated, down to the full resolution. The remaining points are interpolated from the
+ * corners of their cells. Points with known[k] != 0 are not integrated, their results are
+ * taken as given. The counters of the points that are not integrated are zero.
+ */
+void smegno_refine(const integrator *in, int nx, int ny, double **xv, int stride, double tol,
+    const char *known, double *megno, double *err, double *tstop) {
+  cell *base, *cells, *next, *swap, c;
+  char *state;
+  int *queue, *gx, *gy;
+  double *buf[12], lo, hi, f[4];
+  int n, nc, nn, nq, ngx, ngy, xm, ym, i, j, k;
+
+  n = nx*ny;
+
+  if (!known && (stride <= 1 || n == 1)) {
+    smegnov(in, n, xv, megno, err, tstop);
+    return;
+  }
+
+  state = calloc(n, sizeof(char));
+  queue = malloc(n*sizeof(int));
+  base = malloc(2*n*sizeof(cell));
+  gx = malloc((nx+ny+2)*sizeof(int));
+  buf[0] = malloc(12*n*sizeof(double));
+
+  if (!state || !queue || !base || !gx || !buf[0]) {
+    free(state); free(queue); free(base); free(gx); free(buf[0]);
+    smegnov(in, n, xv, megno, err, tstop);
+    return;
+  }
+
+  if (known) {
+    for (k = 0; k < n; k++) {
+      if (known[k]) state[k] = POINT_COMPUTED;
+    }
+  }
+
+  if (stride <= 1) stride = 1;
+
+  cells = base;
+  next = base + n;
+  gy = gx + nx + 1;
+  for (i = 1; i < 12; i++) buf[i] = buf[0] + i*n;
+
+  if (in->cnt) {
+    for (k = 0; k < n; k++) in->cnt->ticks[k] = in->cnt->steps[k] = in->cnt->kicks[k] = 0.0;
+  }
+
+  /* The coarse grid */
+  ngx = 0;
+  for (i = 0; i < nx - 1; i += stride) gx[ngx++] = i;
+  gx[ngx++] = nx - 1;
+
+  ngy = 0;
+  for (j = 0; j < ny - 1; j += stride) gy[ngy++] = j;
+  gy[ngy++] = ny - 1;
+
+  nq = 0;
+  for (j = 0; j < ngy; j++) {
+    for (i = 0; i < ngx; i++) refine_queue(gx[i], gy[j], nx, state, queue, &nq);
+  }
+  refine_compute(in, xv, state, queue, nq, buf, megno, err, tstop);
+
+  nc = 0;
+  for (j = 0; j < (ngy > 1 ? ngy - 1 : 1); j++) {
+    for (i = 0; i < (ngx > 1 ? ngx - 1 : 1); i++) {
+      cells[nc].x0 = gx[i];
+      cells[nc].x1 = gx[ngx > 1 ? i + 1 : i];
+      cells[nc].y0 = gy[j];
+      cells[nc].y1 = gy[ngy > 1 ? j + 1 : j];
+      nc++;
+    }
+  }
+
+  /* Refine level by level, each level is integrated with one call of the batched kernel */
+  while (nc > 0) {
+    nn = 0;
+    nq = 0;
+
+    for (k = 0; k < nc; k++) {
+      c = cells[k];
+
+      if (c.x1 - c.x0 <= 1 && c.y1 - c.y0 <= 1) continue;
+
+      f[0] = megno[c.y0*nx + c.x0];
+      f[1] = megno[c.y0*nx + c.x1];
+      f[2] = megno[c.y1*nx + c.x0];
+      f[3] = megno[c.y1*nx + c.x1];
+      lo = hi = f[0];
+      for (i = 1; i < 4; i++) {
+        if (f[i] < lo) lo = f[i];
+        if (f[i] > hi) hi = f[i];
+      }
+
+      if (hi - lo <= tol) {
+        refine_fill(&c, nx, state, megno);
+        refine_fill(&c, nx, state, err);
+        if (tstop) refine_fill(&c, nx, state, tstop);
+        for (j = c.y0; j <= c.y1; j++) {
+          for (i = c.x0; i <= c.x1; i++) {
+            if (state[j*nx + i] == POINT_EMPTY) state[j*nx + i] = POINT_INTERPOLATED;
+          }
+        }
+        continue;
+      }
+
+      /* Cells one point wide are split along the other axis only */
+      xm = (c.x1 - c.x0 > 1) ? (c.x0 + c.x1)/2 : c.x1;
+      ym = (c.y1 - c.y0 > 1) ? (c.y0 + c.y1)/2 : c.y1;
+
+      refine_queue(xm, c.y0, nx, state, queue, &nq);
+      refine_queue(xm, ym, nx, state, queue, &nq);
+      refine_queue(c.x0, ym, nx, state, queue, &nq);
+      next[nn++] = (cell) {c.x0, xm, c.y0, ym};
+
+      if (xm < c.x1) {
+        refine_queue(c.x1, ym, nx, state, queue, &nq);
+        next[nn++] = (cell) {xm, c.x1, c.y0, ym};
+      }
+      if (ym < c.y1) {
+        refine_queue(xm, c.y1, nx, state, queue, &nq);
+        next[nn++] = (cell) {c.x0, xm, ym, c.y1};
+      }
+      if (xm < c.x1 && ym < c.y1) next[nn++] = (cell) {xm, c.x1, ym, c.y1};
+    }
+
+    refine_compute(in, xv, state, queue, nq, buf, megno, err, tstop);
+
+    swap = cells;
+    cells = next;
+    next = swap;
+    nc = nn;
+  }
+
+  free(state);
+  free(queue);
+  free(base);
+  free(gx);
+  free(buf[0]);
+}
+
+/**
+ * Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008)
+ * with the modified Leapfrog integrator SABA2 (Laskar & Robutel, CMDA, 2001)
+ */
+double smegno2(double *xv0, double step, double tend, double eps, double *err) {
+  double *xv[6] = {&xv0[0], &xv0[1], &xv0[2], &xv0[3], &xv0[4], &xv0[5]};
+  integrator in = {.driver = AWEB_SABA2, .step = step, .tend = tend, .eps = eps};
+  double result;
+
+  smegnov(&in, 1, xv, &result, err, NULL);
+
+  return result;
+}
+
+/**
+ * Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008)
+ * with the SABA3 integrator (Laskar & Robutel, CMDA, 2001)
+ */
+double smegno3(double *xv0, double step, double tend, double eps,  double *err) {
+  double *xv[6] = {&xv0[0], &xv0[1], &xv0[2], &xv0[3], &xv0[4], &xv0[5]};
+  integrator in = {.driver = AWEB_SABA3, .step = step, .tend = tend, .eps = eps};
+  double result;
+
+  smegnov(&in, 1, xv, &result, err, NULL);
+
+  return result;
+}
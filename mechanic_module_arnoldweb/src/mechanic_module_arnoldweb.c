@@ -66,7 +66,7 @@ int arnoldweb_init(int mpi_size, int node, TaskInfo *info, TaskConfig *config) {
   info->input_length = 6;
 
 #ifdef LRC
-  info->options = 8;
+  info->options = 12;
 #endif
 
   return MECHANIC_TASK_SUCCESS;
@@ -90,6 +90,10 @@ int arnoldweb_init(int mpi_size, int node, TaskInfo *info, TaskConfig *config) {
  * tend = 20000.0
  * eps = 0.01
  * driver = 1 
+ * angle1 = 0.131
+ * angle2 = 0.132
+ * angle3 = 0.212
+ * action3 = 0.01
  * 
  * After the configuration is done, we may use it as follows:
  * > xmin = LRC_option2double("arnold", "xmin", info->moptions);
@@ -112,44 +116,103 @@ int arnoldweb_setup_schema(TaskInfo *info) {
     .space="arnold", .name="eps", .value="0.01", .type=LRC_DOUBLE};
   info->mconfig[7] = (LRC_configDefaults) {
     .space="arnold", .name="driver", .value="1", .type=LRC_INT};
+  info->mconfig[8] = (LRC_configDefaults) {
+    .space="arnold", .name="angle1", .value="0.131", .type=LRC_DOUBLE};
+  info->mconfig[9] = (LRC_configDefaults) {
+    .space="arnold", .name="angle2", .value="0.132", .type=LRC_DOUBLE};
+  info->mconfig[10] = (LRC_configDefaults) {
+    .space="arnold", .name="angle3", .value="0.212", .type=LRC_DOUBLE};
+  info->mconfig[11] = (LRC_configDefaults) {
+    .space="arnold", .name="action3", .value="0.01", .type=LRC_DOUBLE};
 
   return MECHANIC_TASK_SUCCESS;
 }
 #endif
 
+/**
+ * The module parameters, parsed once on each node
+ */
+typedef struct {
+  int parsed;
+  double xmin, xmax, ymin, ymax;
+  double step; /* The time step, scaled by (sqrt(5)-1)/2 */
+  double tend;
+  double eps;
+  int driver;
+  double angle[3]; /* The initial angles */
+  double action3; /* The initial third action */
+} arnoldweb_params;
+
+static arnoldweb_params params = {.parsed = 0};
+
 /**
  * @function
- * Implements module_task_prepare().
+ * Returns the module parameters.
  *
- * We prepare here the initial condition for the task. The length of the `in->data`
- * vector is allocated according to the `info->input_length` variable. We use the default,
- * two-dimensional mapping of the coordinates of the current task (out->coords).
+ * The string lookups of the configuration are done only on the first call, the task
+ * functions read the parsed values afterwards.
  */
-int arnoldweb_task_prepare(int node, TaskInfo *info, TaskConfig *config, TaskData *in, TaskData *out) {
-  double xmin, xmax, ymin, ymax;
+static arnoldweb_params* arnoldweb_parameters(TaskInfo *info) {
+
+  if (params.parsed) return &params;
 
   /* Global map range (equivalent of frequencies space) */
-  xmin  = 0.8;
-  xmax  = 1.2;
-  ymin  = 0.8;
-  ymax  = 1.2;         
+  params.xmin   = 0.8;
+  params.xmax   = 1.2;
+  params.ymin   = 0.8;
+  params.ymax   = 1.2;
+
+  params.step   = 0.25;
+  params.tend   = 20000.0;
+  params.eps    = 0.01;
+  params.driver = 1;
+
+  params.angle[0] = 0.131;
+  params.angle[1] = 0.132;
+  params.angle[2] = 0.212;
+  params.action3  = 0.01;
 
 #ifdef LRC
-  xmin = LRC_option2double("arnold", "xmin", info->moptions);
-  xmax = LRC_option2double("arnold", "xmax", info->moptions);
-  ymin = LRC_option2double("arnold", "ymin", info->moptions);
-  ymax = LRC_option2double("arnold", "ymax", info->moptions);
+  params.xmin   = LRC_option2double("arnold", "xmin", info->moptions);
+  params.xmax   = LRC_option2double("arnold", "xmax", info->moptions);
+  params.ymin   = LRC_option2double("arnold", "ymin", info->moptions);
+  params.ymax   = LRC_option2double("arnold", "ymax", info->moptions);
+  params.step   = LRC_option2double("arnold", "step", info->moptions);
+  params.tend   = LRC_option2double("arnold", "tend", info->moptions);
+  params.eps    = LRC_option2double("arnold", "eps", info->moptions);
+  params.driver = LRC_option2int("arnold", "driver", info->moptions);
+  params.angle[0] = LRC_option2double("arnold", "angle1", info->moptions);
+  params.angle[1] = LRC_option2double("arnold", "angle2", info->moptions);
+  params.angle[2] = LRC_option2double("arnold", "angle3", info->moptions);
+  params.action3  = LRC_option2double("arnold", "action3", info->moptions);
 #endif
 
+  params.step   = params.step*(pow(5,0.5)-1)/2.0;
+  params.parsed = 1;
+
+  return &params;
+}
+
+/**
+ * @function
+ * Implements module_task_prepare().
+ *
+ * We prepare here the initial condition for the task. The length of the `in->data`
+ * vector is allocated according to the `info->input_length` variable. We use the default,
+ * two-dimensional mapping of the coordinates of the current task (out->coords).
+ */
+int arnoldweb_task_prepare(int node, TaskInfo *info, TaskConfig *config, TaskData *in, TaskData *out) {
+  arnoldweb_params *p = arnoldweb_parameters(info);
+
   /* Initial condition - angles */
-  in->data[0] = 0.131;
-  in->data[1] = 0.132;
-  in->data[2] = 0.212;
+  in->data[0] = p->angle[0];
+  in->data[1] = p->angle[1];
+  in->data[2] = p->angle[2];
 
   /* Map coordinates */  
-  in->data[3] = xmin + out->coords[0]*(xmax-xmin)/(1.0*config->xres);
-  in->data[4] = ymin + out->coords[1]*(ymax-ymin)/(1.0*config->yres);
-  in->data[5] = 0.01;  
+  in->data[3] = p->xmin + out->coords[0]*(p->xmax-p->xmin)/(1.0*config->xres);
+  in->data[4] = p->ymin + out->coords[1]*(p->ymax-p->ymin)/(1.0*config->yres);
+  in->data[5] = p->action3;
 
   return MECHANIC_TASK_SUCCESS;
 }
@@ -165,22 +228,8 @@ int arnoldweb_task_prepare(int node, TaskInfo *info, TaskConfig *config, TaskDat
  * After the computations are finished, we return the final result to the master node.
  */
 int arnoldweb_task_process(int node, TaskInfo *info, TaskConfig *config, TaskData *in, TaskData *out) {
-  double err, xv[6], tend, step, eps, result;
-#ifdef LRC
-  int driver;
-#endif
-
-  step  = 0.25*(pow(5,0.5)-1)/2.0;
-  tend  = 20000.0;
-  eps   = 0.01;
-
-#ifdef LRC  
-  step = LRC_option2double("arnold", "step", info->moptions);
-  step  = step*(pow(5,0.5)-1)/2.0;
-  tend = LRC_option2double("arnold", "tend", info->moptions);
-  eps  = LRC_option2double("arnold", "eps", info->moptions);
-  driver = LRC_option2int("arnold", "driver", info->moptions);
-#endif
+  arnoldweb_params *p = arnoldweb_parameters(info);
+  double err, xv[6], result;
 
   /* Initial data */  
   xv[0] = in->data[0];
@@ -191,12 +240,11 @@ int arnoldweb_task_process(int node, TaskInfo *info, TaskConfig *config, TaskDat
   xv[5] = in->data[5];  
 
   /* Numerical integration goes here */
-#ifdef LRC
-  if (driver == 1) result = smegno2(xv, step, tend, eps, &err);
-  if (driver == 2) result = smegno3(xv, step, tend, eps, &err);
-#else  
-  result = smegno2(xv, step, tend, eps, &err);
-#endif
+  if (p->driver == 2) {
+    result = smegno3(xv, p->step, p->tend, p->eps, &err);
+  } else {
+    result = smegno2(xv, p->step, p->tend, p->eps, &err);
+  }
 
   /* Assign the master result */
   out->data[0] = xv[3];
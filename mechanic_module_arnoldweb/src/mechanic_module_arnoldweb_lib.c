@@ -6,6 +6,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
 
 #include "mechanic_module_arnoldweb.h"
@@ -105,13 +107,42 @@ double norm(int dim, double *a, int flag) {
   double tmp = 0.0;
   int i;
   
-  for (i=1; i<=dim; i++) tmp += a[i]*a[i];
+  for (i=0; i<dim; i++) tmp += a[i]*a[i];
   tmp = sqrt(tmp);
-  if (flag) for (i=1; i<=dim; i++) a[i]= a[i]/tmp;  
+  if (flag) for (i=0; i<dim; i++) a[i]= a[i]/tmp;  
 
   return tmp;
 }
 
+/**
+ * @function
+ * The SplitMix64 mixing function (Steele, Lea & Flood, OOPSLA 2014)
+ */
+static uint64_t splitmix64(uint64_t x) {
+  x = x + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * @function
+ * Sets the tangent vector from a counter-based generator keyed by the initial condition,
+ * so that the result of a task does not depend on the node or the order of the tasks
+ */
+static void tangent(double *xv, double *dy) {
+  uint64_t h, bits;
+  int i;
+
+  h = 0;
+  for (i=0; i<6; i++) {
+    memcpy(&bits, &xv[i], sizeof(bits));
+    h = splitmix64(h ^ bits);
+  }
+
+  for (i=0; i<6; i++) dy[i] = (splitmix64(h + i) >> 11)*(1.0/9007199254740992.0);
+}
+
 /**
  * @function
  * Symplectic MEGNO (Gozdziewski, Breiter & Borczyk, MNRAS, 2008)
@@ -135,13 +166,14 @@ double smegno2(double *xv0, double step, double tend, double eps, double *err) {
   Y0    = mY0   = Y1    = mY1   = 0.0;
 
   /* Initialize state vector */
-  for (i=0; i<=6; i++) xv[i] = xv0[i];
+  for (i=0; i<6; i++) xv[i] = xv0[i];
 
   /* Set the tangent vector */
-  for (i=0; i<=6; i++) dy[i] = rand()/(RAND_MAX+1.0);
+  tangent(xv, dy);
   
   /* Normalize the tangent vector */
-  delta0= norm(6, dy, 1); 
+  norm(6, dy, 1);
+  delta0= 1.0; 
   en0   = energy(xv, eps);
   v0    = variat(xv, dy, eps);
   
@@ -225,16 +257,18 @@ double smegno3(double *xv0, double step, double tend, double eps,  double *err)
                   
   t     = 0.0;
   maxe  = 0.0;
+  checkout = 1000;
   Y0    = mY0   = Y1    = mY1   = 0.0;
 
   /* Initialize state vector */
-  for (i=0; i<=6; i++) xv[i] = xv0[i];
+  for (i=0; i<6; i++) xv[i] = xv0[i];
 
   /* Set the tangent vector */
-  for (i=0; i<=6; i++) dy[i] = rand()/(RAND_MAX+1.0);
+  tangent(xv, dy);
   
-  /* Randomize the tangent vector */
-  delta0= norm(6, dy, 1); 
+  /* Normalize the tangent vector */
+  norm(6, dy, 1);
+  delta0= 1.0; 
 
   en0   = energy(xv, eps);
   v0    = variat(xv, dy, eps);
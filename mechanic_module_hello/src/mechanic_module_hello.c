@@ -164,13 +164,156 @@
 #include "mechanic.h"
 #include "mechanic_module_hello.h"
 
+/**
+ * The tile size K: with K > 1 each task covers a KxK block of pixels, read
+ * from the HELLO_TILE environment variable at the module initialization
+ */
+static int tile = 1;
+
+/**
+ * The tiles in the Hilbert order, indexed by the task number
+ */
+static int *order = NULL;
+
+/**
+ * The benchmark mode, set with the HELLO_BENCH environment variable
+ */
+typedef struct {
+  int enabled;
+  int input_length; /**< The payload sizes (HELLO_INPUT, HELLO_OUTPUT) */
+  int output_length;
+  int base_length; /**< The length of the regular result */
+  double delay; /**< The synthetic compute time of a task (HELLO_DELAY), in us */
+  const char *report; /**< The prefix of the report files (HELLO_REPORT) */
+  double start; /**< The module initialization time */
+  double first, last; /**< The start of the first task, the end of the last one */
+  long int tasks;
+  double *latency; /**< The round trips between the tasks, in us */
+  long int nlatency, size;
+} hello_benchmark;
+
+static hello_benchmark bench = {.enabled = 0};
+
+/**
+ * The wall clock time in us
+ */
+static double hello_time(void){
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return 1e6*tv.tv_sec + tv.tv_usec;
+}
+
+static int hello_compare(const void *a, const void *b){
+  double x = *(const double*) a, y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Writes the benchmark report of the node to <prefix>-<node>.json and .csv.
+ *
+ * A worker reports the tasks it processed and the round trips between them
+ * (from the end of a task to the start of the next one: sending the result,
+ * the master turnaround and receiving the next task). A node without tasks
+ * (the master) reports the whole farm, from the initialization to the cleanup.
+ */
+static void hello_report(int node, TaskConfig* d){
+
+  double wall, tasks, bytes, mean, p50, p90, p99, max;
+  char name[1024];
+  const char *role;
+  FILE *f;
+  long int i;
+
+  if (bench.tasks > 0) {
+    role = "worker";
+    tasks = (double) bench.tasks;
+    wall = (bench.last - bench.first)*1e-6;
+  } else {
+    role = "master";
+    tasks = (double) d->xres * d->yres;
+    wall = (hello_time() - bench.start)*1e-6;
+  }
+  if (wall <= 0.0) wall = 1e-6;
+  bytes = tasks * (bench.input_length + bench.output_length) * sizeof(double);
+
+  mean = p50 = p90 = p99 = max = 0.0;
+  if (bench.nlatency > 0) {
+    qsort(bench.latency, bench.nlatency, sizeof(double), hello_compare);
+    for (i = 0; i < bench.nlatency; i++) mean += bench.latency[i];
+    mean /= bench.nlatency;
+    p50 = bench.latency[(50*bench.nlatency + 99)/100 - 1];
+    p90 = bench.latency[(90*bench.nlatency + 99)/100 - 1];
+    p99 = bench.latency[(99*bench.nlatency + 99)/100 - 1];
+    max = bench.latency[bench.nlatency - 1];
+  }
+
+  snprintf(name, sizeof(name), "%s-%02d.json", bench.report, node);
+  f = fopen(name, "w");
+  if (f != NULL) {
+    fprintf(f, "{\"node\": %d, \"role\": \"%s\", \"tasks\": %.0f, "
+        "\"input_length\": %d, \"output_length\": %d, \"delay_us\": %g, "
+        "\"wall_s\": %.6f, \"tasks_per_s\": %.3f, \"bytes_per_s\": %.3f, "
+        "\"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+        "\"p99\": %.3f, \"max\": %.3f}}\n",
+        node, role, tasks, bench.input_length, bench.output_length, bench.delay,
+        wall, tasks/wall, bytes/wall, mean, p50, p90, p99, max);
+    fclose(f);
+  }
+
+  snprintf(name, sizeof(name), "%s-%02d.csv", bench.report, node);
+  f = fopen(name, "w");
+  if (f != NULL) {
+    fprintf(f, "node,role,tasks,input_length,output_length,delay_us,wall_s,"
+        "tasks_per_s,bytes_per_s,latency_mean_us,latency_p50_us,latency_p90_us,"
+        "latency_p99_us,latency_max_us\n");
+    fprintf(f, "%d,%s,%.0f,%d,%d,%g,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+        node, role, tasks, bench.input_length, bench.output_length, bench.delay,
+        wall, tasks/wall, bytes/wall, mean, p50, p90, p99, max);
+    fclose(f);
+  }
+}
+
 /**
  * Implementation of module_init().
+ *
+ * In the tile mode the result of a task is packed as the pixel coordinates of
+ * the tile origin, the initial data, and the coordinates of the KxK pixels.
  */
 int hello_init(int mpi_size, int node, TaskInfo* md, TaskConfig* d){
 
+  char *env;
+
+  env = getenv("HELLO_TILE");
+  tile = (env != NULL) ? atoi(env) : 1;
+  if (tile < 1) tile = 1;
+
   md->input_length = 3;
-  md->output_length = 6;
+  md->output_length = (tile > 1) ? 6 + 2*tile*tile : 6;
+
+  env = getenv("HELLO_BENCH");
+  bench.enabled = (env != NULL) ? atoi(env) : 0;
+  if (bench.enabled) {
+    env = getenv("HELLO_INPUT");
+    if (env != NULL && atoi(env) > md->input_length) md->input_length = atoi(env);
+    bench.base_length = md->output_length;
+    env = getenv("HELLO_OUTPUT");
+    if (env != NULL && atoi(env) > md->output_length) md->output_length = atoi(env);
+    env = getenv("HELLO_DELAY");
+    bench.delay = (env != NULL) ? atof(env) : 0.0;
+    env = getenv("HELLO_REPORT");
+    bench.report = (env != NULL) ? env : "hello-bench";
+
+    bench.input_length = md->input_length;
+    bench.output_length = md->output_length;
+    bench.tasks = 0;
+    bench.nlatency = 0;
+    bench.size = 0;
+    bench.latency = NULL;
+    bench.start = hello_time();
+  }
 
   return MECHANIC_TASK_SUCCESS;
 }
@@ -180,9 +323,64 @@ int hello_init(int mpi_size, int node, TaskInfo* md, TaskConfig* d){
  */
 int hello_cleanup(int mpi_size, int node, TaskInfo* md, TaskConfig* d){
 
+  free(order);
+  order = NULL;
+
+  if (bench.enabled) {
+    hello_report(node, d);
+    free(bench.latency);
+    bench.latency = NULL;
+  }
+
   return MECHANIC_TASK_SUCCESS;
 }
 
+/**
+ * Returns the tiles of the nx x ny grid in the order of the Hilbert curve of
+ * the smallest power-of-two square covering the grid (the cells outside the
+ * grid are skipped), so that the consecutive tasks get neighbouring tiles.
+ */
+static int* hello_tile_order(int nx, int ny){
+
+  int *tiles;
+  long int h, t, cells;
+  int n, s, x, y, rx, ry, temp;
+  int k;
+
+  tiles = calloc((size_t) nx*ny, sizeof(int));
+  if (tiles == NULL) return NULL;
+
+  n = 1;
+  while (n < nx || n < ny) n *= 2;
+  cells = (long int) n*n;
+
+  k = 0;
+  for (h = 0; h < cells; h++) {
+    x = 0;
+    y = 0;
+    t = h;
+    for (s = 1; s < n; s *= 2) {
+      rx = (int) (1 & (t/2));
+      ry = (int) (1 & (t ^ rx));
+      if (ry == 0) {
+        if (rx == 1) {
+          x = s - 1 - x;
+          y = s - 1 - y;
+        }
+        temp = x;
+        x = y;
+        y = temp;
+      }
+      x += s*rx;
+      y += s*ry;
+      t /= 4;
+    }
+    if (x < nx && y < ny) tiles[k++] = y*nx + x;
+  }
+
+  return tiles;
+}
+
 /**
  * Implementation of module_node_in().
  */
@@ -213,18 +411,70 @@ int hello_task_prepare(int node, TaskInfo* md, TaskConfig* d,
 
 /**
  * Implementation of module_task_process().
+ *
+ * In the tile mode the task grid (xres x yres) is the grid of tiles, and the
+ * task number coords[0]*yres + coords[1] selects the tile along the Hilbert
+ * curve.
  */
 int hello_task_process(int node, TaskInfo* md, TaskConfig* d,
     TaskData* inidata, TaskData* r)
 {
 
-  r->data[0] = (double) r->coords[0];
-  r->data[1] = (double) r->coords[1];
+  int t, x0, y0, i, j, k;
+  double now, *latency;
+
+  if (bench.enabled) {
+    now = hello_time();
+    if (bench.tasks > 0) {
+      if (bench.nlatency == bench.size) {
+        bench.size = (bench.size > 0) ? 2*bench.size : 1024;
+        latency = realloc(bench.latency, bench.size*sizeof(double));
+        if (latency == NULL) return MECHANIC_MODULE_ERR_MEM;
+        bench.latency = latency;
+      }
+      bench.latency[bench.nlatency++] = now - bench.last;
+    } else {
+      bench.first = now;
+    }
+
+    /* The synthetic compute, a busy wait */
+    while (hello_time() - now < bench.delay);
+
+    for (k = bench.base_length; k < bench.output_length; k++) r->data[k] = (double) k;
+  }
+
+  if (tile > 1) {
+    if (order == NULL) order = hello_tile_order(d->xres, d->yres);
+    if (order == NULL) return MECHANIC_MODULE_ERR_MEM;
+
+    t = order[r->coords[0]*d->yres + r->coords[1]];
+    x0 = (t % d->xres)*tile;
+    y0 = (t / d->xres)*tile;
+
+    r->data[0] = (double) x0;
+    r->data[1] = (double) y0;
+
+    for (j = 0; j < tile; j++) {
+      for (i = 0; i < tile; i++) {
+        r->data[6 + 2*(j*tile + i)] = (double) (x0 + i);
+        r->data[7 + 2*(j*tile + i)] = (double) (y0 + j);
+      }
+    }
+  } else {
+    r->data[0] = (double) r->coords[0];
+    r->data[1] = (double) r->coords[1];
+  }
+
   r->data[2] = (double) r->coords[2];
   r->data[3] = inidata->data[0];
   r->data[4] = inidata->data[1];
   r->data[5] = inidata->data[2];
 
+  if (bench.enabled) {
+    bench.last = hello_time();
+    bench.tasks++;
+  }
+
   return MECHANIC_TASK_SUCCESS;
 }
 
@@ -12,7 +12,11 @@
  * We use here only 3 functions: @c mandelbrot_init(), @c mandelbrot_cleanup()
  * and @c mandelbrot_task_process(). There is an additional function,
  * @c mandelbrot_generate_fractal(), which shows that you can even add external
- * functions to your module, since it is a standard C code.
+ * functions to your module, since it is a standard C code. The batched
+ * @c mandelbrot_generate_fractalv() iterates @c MANDELBROT_LANES points at once,
+ * and the single point version is a wrapper of it. For the deep zooms,
+ * @c mandelbrot_perturbationv() iterates only the offsets of the points from
+ * the reference orbit of the view center.
  *
  * In addition, the module returns the number of node that computed the task.
  *
@@ -22,80 +26,893 @@
  * @endcode
  */
 
+#include <math.h>
+
 #include "mechanic.h"
 #include "mechanic_module_mandelbrot.h"
 
+/**
+ * The tile size K: with K > 1 each task computes a KxK block of pixels. The
+ * result length depends on it, so it is read from the MANDELBROT_TILE
+ * environment variable at the module initialization
+ */
+static int tile = 1;
+
+/**
+ * Store the smooth iteration counts and the distance estimates (set with the
+ * MANDELBROT_SMOOTH environment variable at the module initialization)
+ */
+static int smoothing = 0;
+
+/**
+ * The adaptive supersampling: the pixels whose count differs from one of
+ * their neighbours get SxS subsamples (S is set with the MANDELBROT_AA
+ * environment variable at the module initialization, 0 - off)
+ */
+static int supersample = 0;
+
 /**
  * Implementation of module_init().
+ *
+ * In the tile mode the result of a task is packed as the pixel coordinates of
+ * the tile origin, the worker, and the KxK iteration counts (row by row).
+ *
+ * With MANDELBROT_SMOOTH=1 the smooth counts and the distance estimates follow
+ * as two more columns (after the KxK counts: KxK smooth counts and KxK
+ * distances in the tile mode). With MANDELBROT_AA=S the antialiased values
+ * come last (KxK of them in the tile mode).
  */
 int mandelbrot_init(int mpi_size, int node, TaskInfo* md, TaskConfig* d){
 
-  md->output_length = 4;
+  char *env;
+
+  env = getenv("MANDELBROT_TILE");
+  tile = (env != NULL) ? atoi(env) : 1;
+  if (tile < 1) tile = 1;
+
+  env = getenv("MANDELBROT_SMOOTH");
+  smoothing = (env != NULL) ? atoi(env) : 0;
+
+  env = getenv("MANDELBROT_AA");
+  supersample = (env != NULL) ? atoi(env) : 0;
+  if (supersample < 2) supersample = 0;
+
+  md->output_length = (tile > 1) ? 3 + tile*tile : 4;
+  if (smoothing) md->output_length += (tile > 1) ? 2*tile*tile : 2;
+  if (supersample) md->output_length += tile*tile;
   md->input_length = 4;
 
+#ifdef LRC
+  md->options = 10;
+#endif
+
   return MECHANIC_TASK_SUCCESS;
 }
 
+#ifdef LRC
+/**
+ * Implementation of module_setup_schema().
+ *
+ * The iteration limit, the bailout (the squared escape radius) and the view
+ * can be changed in the config file:
+ *
+ * [mandelbrot]
+ * max_iter = 256
+ * bailout = 4.0
+ * center_re = 0.0
+ * center_im = 0.0
+ * offset_re = 0.0
+ * offset_im = 0.0
+ * width = 4.0
+ * height = 4.0
+ * perturbation = 0
+ * aa_threshold = 0
+ *
+ * The center of the view is (center_re + offset_re, center_im + offset_im),
+ * kept in double-double precision, so that the offsets give the digits of deep
+ * zooms which do not fit into a double. The width and the height are the sizes
+ * of the view in the complex plane. With perturbation = 1 the pixels are
+ * iterated as the deltas from the reference orbit of the center. In the
+ * adaptive supersampling the pixels whose count differs by more than
+ * aa_threshold from the count of one of their neighbours are subsampled.
+ */
+int mandelbrot_setup_schema(TaskInfo* md){
+
+  md->mconfig[0] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="max_iter", .value="256", .type=LRC_INT};
+  md->mconfig[1] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="bailout", .value="4.0", .type=LRC_DOUBLE};
+  md->mconfig[2] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="center_re", .value="0.0", .type=LRC_DOUBLE};
+  md->mconfig[3] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="center_im", .value="0.0", .type=LRC_DOUBLE};
+  md->mconfig[4] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="offset_re", .value="0.0", .type=LRC_DOUBLE};
+  md->mconfig[5] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="offset_im", .value="0.0", .type=LRC_DOUBLE};
+  md->mconfig[6] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="width", .value="4.0", .type=LRC_DOUBLE};
+  md->mconfig[7] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="height", .value="4.0", .type=LRC_DOUBLE};
+  md->mconfig[8] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="perturbation", .value="0", .type=LRC_INT};
+  md->mconfig[9] = (LRC_configDefaults) {
+    .space="mandelbrot", .name="aa_threshold", .value="0", .type=LRC_INT};
+
+  return MECHANIC_TASK_SUCCESS;
+}
+#endif
+
+/**
+ * The module parameters, parsed once on each node
+ */
+typedef struct {
+  int parsed;
+  int max_iter;
+  double bailout;
+  double center_re, center_im; /**< The center of the view, the high parts */
+  double offset_re, offset_im; /**< The center of the view, the low parts */
+  double width, height; /**< The size of the view */
+  int perturbation; /**< Iterate the deltas from the reference orbit */
+  int aa_threshold; /**< The count difference which marks a pixel to subsample */
+  int nref; /**< The length of the reference orbit */
+  double *ref_re, *ref_im; /**< The reference orbit of the center */
+  int *order; /**< The tiles in the Hilbert order, indexed by the task number */
+  double *a, *b, *da, *db; /**< The points of a tile and their offsets */
+  int *count; /**< The iteration counts of a tile */
+  double *smooth, *distance; /**< The smooth counts and distances of a tile */
+  double *sa, *sb, *sda, *sdb; /**< The subsamples of a tile */
+  int *scount; /**< The iteration counts of the subsamples */
+  double *ssmooth, *sdistance; /**< The smooth counts and distances of the subsamples */
+  double *aa; /**< The antialiased values of a tile */
+  int *marked; /**< The pixels of a tile to subsample, in the order of the subsamples */
+} mandelbrot_params;
+
+static mandelbrot_params params = {.parsed = 0};
+
+/**
+ * The double-double arithmetic of the reference orbit: a number is the
+ * unevaluated sum hi + lo of two doubles, about 32 significant digits
+ */
+typedef struct {
+  double hi, lo;
+} mandelbrot_dd;
+
+static mandelbrot_dd dd_renorm(double s, double e){
+  mandelbrot_dd r;
+
+  r.hi = s + e;
+  r.lo = e - (r.hi - s);
+
+  return r;
+}
+
+static mandelbrot_dd dd_add(mandelbrot_dd a, mandelbrot_dd b){
+  double s, v, e;
+
+  s = a.hi + b.hi;
+  v = s - a.hi;
+  e = (a.hi - (s - v)) + (b.hi - v);
+
+  return dd_renorm(s, e + a.lo + b.lo);
+}
+
+static mandelbrot_dd dd_mul(mandelbrot_dd a, mandelbrot_dd b){
+  double p, e;
+
+  p = a.hi*b.hi;
+  e = fma(a.hi, b.hi, -p) + (a.hi*b.lo + a.lo*b.hi);
+
+  return dd_renorm(p, e);
+}
+
+/**
+ * Computes the reference orbit Z(n+1) = Z(n)^2 + C of the view center C in the
+ * double-double precision and stores it rounded to doubles. The orbit ends when
+ * it escapes or reaches max_iter.
+ */
+static int mandelbrot_reference(mandelbrot_params *p){
+
+  mandelbrot_dd cr, ci, zr, zi, zr2, zi2, zri;
+  int n;
+
+  p->ref_re = calloc(p->max_iter + 2, sizeof(double));
+  p->ref_im = calloc(p->max_iter + 2, sizeof(double));
+  if (p->ref_re == NULL || p->ref_im == NULL) return MECHANIC_MODULE_ERR_MEM;
+
+  cr = dd_renorm(p->center_re, p->offset_re);
+  ci = dd_renorm(p->center_im, p->offset_im);
+  zr = dd_renorm(0.0, 0.0);
+  zi = dd_renorm(0.0, 0.0);
+
+  p->ref_re[0] = 0.0;
+  p->ref_im[0] = 0.0;
+
+  for (n = 1; n <= p->max_iter + 1; n++) {
+    zr2 = dd_mul(zr, zr);
+    zi2 = dd_mul(zi, zi);
+    zri = dd_mul(zr, zi);
+    zri.hi = 2*zri.hi;
+    zri.lo = 2*zri.lo;
+    zi2.hi = -zi2.hi;
+    zi2.lo = -zi2.lo;
+    zr = dd_add(dd_add(zr2, zi2), cr);
+    zi = dd_add(zri, ci);
+
+    p->ref_re[n] = zr.hi + zr.lo;
+    p->ref_im[n] = zi.hi + zi.lo;
+
+    if (p->ref_re[n]*p->ref_re[n] + p->ref_im[n]*p->ref_im[n] >= p->bailout) {
+      n++;
+      break;
+    }
+  }
+
+  p->nref = n;
+
+  return MECHANIC_TASK_SUCCESS;
+}
+
+/**
+ * Returns the tiles of the nx x ny grid in the order of the Hilbert curve of
+ * the smallest power-of-two square covering the grid (the cells outside the
+ * grid are skipped). The neighbouring tasks of the farm then get neighbouring
+ * tiles of similar cost, and the expensive regions of the view are spread
+ * over the whole run instead of coming in a few long rows.
+ */
+static int* mandelbrot_tile_order(int nx, int ny){
+
+  int *order;
+  long int h, t, q, cells;
+  int n, s, x, y, rx, ry, temp;
+  int k;
+
+  order = calloc((size_t) nx*ny, sizeof(int));
+  if (order == NULL) return NULL;
+
+  n = 1;
+  while (n < nx || n < ny) n *= 2;
+  cells = (long int) n*n;
+
+  k = 0;
+  for (h = 0; h < cells; h++) {
+    x = 0;
+    y = 0;
+    t = h;
+    for (s = 1; s < n; s *= 2) {
+      q = t/2;
+      rx = (int) (1 & q);
+      ry = (int) (1 & (t ^ rx));
+      if (ry == 0) {
+        if (rx == 1) {
+          x = s - 1 - x;
+          y = s - 1 - y;
+        }
+        temp = x;
+        x = y;
+        y = temp;
+      }
+      x += s*rx;
+      y += s*ry;
+      t /= 4;
+    }
+    if (x < nx && y < ny) order[k++] = y*nx + x;
+  }
+
+  return order;
+}
+
+/**
+ * Frees the buffers of the module parameters, the next call of
+ * mandelbrot_parameters() reads the configuration again
+ */
+static void mandelbrot_parameters_free(void){
+
+  free(params.ref_re);
+  free(params.ref_im);
+  free(params.order);
+  free(params.a);
+  free(params.b);
+  free(params.da);
+  free(params.db);
+  free(params.count);
+  free(params.smooth);
+  free(params.distance);
+  free(params.sa);
+  free(params.sb);
+  free(params.sda);
+  free(params.sdb);
+  free(params.scount);
+  free(params.ssmooth);
+  free(params.sdistance);
+  free(params.aa);
+  free(params.marked);
+  params = (mandelbrot_params) {.parsed = 0};
+}
+
+/**
+ * Returns the module parameters, the configuration is read on the first call only.
+ * On a failure the buffers allocated so far are freed, NULL is returned and mstat
+ * holds the error code
+ */
+static mandelbrot_params* mandelbrot_parameters(TaskInfo* md, TaskConfig* d, int* mstat){
+
+  int n;
+
+  if (params.parsed) return &params;
+
+  params.max_iter = 256;
+  params.bailout = 4.0;
+  params.center_re = 0.0;
+  params.center_im = 0.0;
+  params.offset_re = 0.0;
+  params.offset_im = 0.0;
+  params.width = 4.0;
+  params.height = 4.0;
+  params.perturbation = 0;
+  params.aa_threshold = 0;
+
+#ifdef LRC
+  params.max_iter = LRC_option2int("mandelbrot", "max_iter", md->moptions);
+  params.bailout = LRC_option2double("mandelbrot", "bailout", md->moptions);
+  params.center_re = LRC_option2double("mandelbrot", "center_re", md->moptions);
+  params.center_im = LRC_option2double("mandelbrot", "center_im", md->moptions);
+  params.offset_re = LRC_option2double("mandelbrot", "offset_re", md->moptions);
+  params.offset_im = LRC_option2double("mandelbrot", "offset_im", md->moptions);
+  params.width = LRC_option2double("mandelbrot", "width", md->moptions);
+  params.height = LRC_option2double("mandelbrot", "height", md->moptions);
+  params.perturbation = LRC_option2int("mandelbrot", "perturbation", md->moptions);
+  params.aa_threshold = LRC_option2int("mandelbrot", "aa_threshold", md->moptions);
+#endif
+
+  /* The smooth count divides by log(bailout), it needs bailout > 1 */
+  if (smoothing && params.bailout <= 1.0) {
+    mechanic_message(MECHANIC_MESSAGE_ERR,
+        "The smooth counts need bailout > 1, got %g\n", params.bailout);
+    *mstat = MECHANIC_MODULE_ERR_SETUP;
+    return NULL;
+  }
+
+  *mstat = MECHANIC_MODULE_ERR_MEM;
+
+  params.ref_re = NULL;
+  params.ref_im = NULL;
+  params.nref = 0;
+  if (params.perturbation) {
+    if (mandelbrot_reference(&params) != MECHANIC_TASK_SUCCESS) {
+      mandelbrot_parameters_free();
+      return NULL;
+    }
+  }
+
+  params.order = NULL;
+  if (tile > 1) {
+    params.order = mandelbrot_tile_order(d->xres, d->yres);
+    if (params.order == NULL) {
+      mandelbrot_parameters_free();
+      return NULL;
+    }
+  }
+
+  /* The tile with the border of the neighbours in the supersampling */
+  n = (supersample) ? (tile + 2)*(tile + 2) : tile*tile;
+  params.a = calloc(n, sizeof(double));
+  params.b = calloc(n, sizeof(double));
+  params.da = calloc(n, sizeof(double));
+  params.db = calloc(n, sizeof(double));
+  params.count = calloc(n, sizeof(int));
+  params.smooth = calloc(n, sizeof(double));
+  params.distance = calloc(n, sizeof(double));
+  if (params.a == NULL || params.b == NULL || params.da == NULL || params.db == NULL
+      || params.count == NULL || params.smooth == NULL || params.distance == NULL) {
+    mandelbrot_parameters_free();
+    return NULL;
+  }
+
+  n = tile*tile*supersample*supersample;
+  params.sa = calloc(n, sizeof(double));
+  params.sb = calloc(n, sizeof(double));
+  params.sda = calloc(n, sizeof(double));
+  params.sdb = calloc(n, sizeof(double));
+  params.scount = calloc(n, sizeof(int));
+  params.ssmooth = calloc(n, sizeof(double));
+  params.sdistance = calloc(n, sizeof(double));
+  params.aa = calloc(tile*tile, sizeof(double));
+  params.marked = calloc(tile*tile, sizeof(int));
+  if (n > 0 && (params.sa == NULL || params.sb == NULL || params.sda == NULL
+      || params.sdb == NULL || params.scount == NULL || params.ssmooth == NULL
+      || params.sdistance == NULL || params.aa == NULL || params.marked == NULL)) {
+    mandelbrot_parameters_free();
+    return NULL;
+  }
+
+  params.parsed = 1;
+
+  return &params;
+}
+
 /**
  * Implementation of module_cleanup().
  */
 int mandelbrot_cleanup(int mpi_size, int node, TaskInfo* md, TaskConfig* d){
 
+  if (params.parsed) mandelbrot_parameters_free();
+
   return MECHANIC_TASK_SUCCESS;
 }
 
+/**
+ * Computes the counts (and the smooth counts and distances) of n points with
+ * the kernel of the configured mode
+ */
+static void mandelbrot_render(mandelbrot_params *p, int n, const double *a,
+    const double *b, const double *da, const double *db, int *count, double *smooth,
+    double *distance){
+
+  if (p->perturbation && smoothing) {
+    mandelbrot_perturbation_smoothv(n, da, db, p->ref_re, p->ref_im, p->nref, p->bailout,
+        p->max_iter, count, smooth, distance);
+  } else if (p->perturbation) {
+    mandelbrot_perturbationv(n, da, db, p->ref_re, p->ref_im, p->nref, p->bailout,
+        p->max_iter, count);
+  } else if (smoothing) {
+    mandelbrot_generate_smoothv(n, a, b, p->bailout, p->max_iter, count, smooth, distance);
+  } else {
+    mandelbrot_generate_fractalv(n, a, b, p->bailout, p->max_iter, count);
+  }
+}
+
+/**
+ * The adaptive supersampling of a tile, the second stage of the render. The
+ * base counts are given on the (K+2)x(K+2) grid of the tile and its border.
+ * A pixel whose count differs by more than aa_threshold from the count of one
+ * of its four neighbours gets SxS subsamples, and its antialiased value is
+ * their mean (of the smooth counts with MANDELBROT_SMOOTH=1). The other pixels
+ * keep their base value.
+ */
+static void mandelbrot_antialias(mandelbrot_params *p, double scale_real,
+    double scale_imag){
+
+  int g, i, j, k, l, m, n, nm, si, sj, diff, flagged, s;
+  double value;
+
+  g = tile + 2;
+  s = supersample;
+  n = 0;
+  nm = 0;
+
+  for (j = 0; j < tile; j++) {
+    for (i = 0; i < tile; i++) {
+      k = (j + 1)*g + (i + 1);
+      flagged = 0;
+      diff = abs(p->count[k] - p->count[k-1]);
+      flagged |= (diff > p->aa_threshold);
+      diff = abs(p->count[k] - p->count[k+1]);
+      flagged |= (diff > p->aa_threshold);
+      diff = abs(p->count[k] - p->count[k-g]);
+      flagged |= (diff > p->aa_threshold);
+      diff = abs(p->count[k] - p->count[k+g]);
+      flagged |= (diff > p->aa_threshold);
+
+      p->aa[j*tile + i] = (smoothing) ? p->smooth[k] : (double) p->count[k];
+      if (!flagged) continue;
+
+      /* The subsamples on the SxS grid within the pixel */
+      for (sj = 0; sj < s; sj++) {
+        for (si = 0; si < s; si++) {
+          p->sda[n] = p->da[k] + ((si + 0.5)/s - 0.5) * scale_real;
+          p->sdb[n] = p->db[k] - ((sj + 0.5)/s - 0.5) * scale_imag;
+          p->sa[n] = (p->center_re + p->offset_re) + p->sda[n];
+          p->sb[n] = (p->center_im + p->offset_im) + p->sdb[n];
+          n++;
+        }
+      }
+
+      /* Mark the pixel, its subsamples follow in the order of the marks */
+      p->marked[nm++] = j*tile + i;
+    }
+  }
+
+  if (n == 0) return;
+
+  mandelbrot_render(p, n, p->sa, p->sb, p->sda, p->sdb, p->scount, p->ssmooth, p->sdistance);
+
+  m = 0;
+  for (k = 0; k < nm; k++) {
+    value = 0.0;
+    for (l = 0; l < s*s; l++, m++) {
+      value += (smoothing) ? p->ssmooth[m] : (double) p->scount[m];
+    }
+    p->aa[p->marked[k]] = value/(s*s);
+  }
+}
+
 /**
  * Implementation of module_task_process().
+ *
+ * In the tile mode the task grid (xres x yres) is the grid of tiles, the image
+ * has (K xres) x (K yres) pixels. The task number coords[0]*yres + coords[1]
+ * selects the tile along the Hilbert curve, and the whole tile goes through
+ * the batched kernel at once.
+ *
+ * In the adaptive supersampling the base render covers also the border of the
+ * tile, so that the pixels at the edges have all their neighbours, and the
+ * marked pixels are subsampled in the second stage. The base counts and the
+ * antialiased values both go to the master datafile.
  */
 int mandelbrot_task_process(int worker, TaskInfo *md, TaskConfig* d,
     TaskData* inidata, TaskData* r){
 
-  double real_min, real_max, imag_min, imag_max;
+  mandelbrot_params *p;
   double scale_real, scale_imag;
-  double c;
+  int x0, y0, nx, ny, t, i, j, k, h, g, n, o, mstat;
 
-  real_min = -2.0;
-  real_max = 2.0;
-  imag_min = -2.0;
-  imag_max = 2.0;
-  c = 4.0;
+  p = mandelbrot_parameters(md, d, &mstat);
+  if (p == NULL) return mstat;
 
-  /* Coordinate system */
-  scale_real = (real_max - real_min) / ((double) d->xres - 1.0);
-  scale_imag = (imag_max - imag_min) / ((double) d->yres - 1.0);
+  x0 = r->coords[0];
+  y0 = r->coords[1];
+  if (tile > 1) {
+    t = p->order[r->coords[0]*d->yres + r->coords[1]];
+    x0 = (t % d->xres)*tile;
+    y0 = (t / d->xres)*tile;
+  }
 
-  r->data[0] = real_min + r->coords[0] * scale_real;
-  r->data[1] = imag_max - r->coords[1] * scale_imag;
+  /* Coordinate system, the offsets of the pixels from the view center */
+  nx = tile*d->xres;
+  ny = tile*d->yres;
+  scale_real = p->width / ((double) nx - 1.0);
+  scale_imag = p->height / ((double) ny - 1.0);
+
+  h = (supersample) ? 1 : 0;
+  g = tile + 2*h;
+  n = g*g;
+
+  for (j = 0; j < g; j++) {
+    for (i = 0; i < g; i++) {
+      k = j*g + i;
+      p->da[k] = (x0 + i - h - 0.5*(nx - 1)) * scale_real;
+      p->db[k] = (0.5*(ny - 1) - (y0 + j - h)) * scale_imag;
+      p->a[k] = (p->center_re + p->offset_re) + p->da[k];
+      p->b[k] = (p->center_im + p->offset_im) + p->db[k];
+    }
+  }
 
   /* Mandelbrot set */
-  r->data[2] = mandelbrot_generate_fractal(r->data[0], r->data[1], c);
+  mandelbrot_render(p, n, p->a, p->b, p->da, p->db, p->count, p->smooth, p->distance);
+  if (supersample) mandelbrot_antialias(p, scale_real, scale_imag);
+
+  if (tile > 1) {
+    r->data[0] = (double) x0;
+    r->data[1] = (double) y0;
+    r->data[2] = (double) worker;
+    o = 3;
+    for (j = 0; j < tile; j++) {
+      for (i = 0; i < tile; i++) {
+        k = (j + h)*g + (i + h);
+        r->data[o + j*tile + i] = (double) p->count[k];
+        if (smoothing) {
+          r->data[o + tile*tile + j*tile + i] = p->smooth[k];
+          r->data[o + 2*tile*tile + j*tile + i] = p->distance[k];
+        }
+      }
+    }
+    o += (smoothing) ? 3*tile*tile : tile*tile;
+    if (supersample) {
+      for (k = 0; k < tile*tile; k++) r->data[o+k] = p->aa[k];
+    }
+    return MECHANIC_TASK_SUCCESS;
+  }
+
+  k = h*g + h;
+  r->data[0] = p->a[k];
+  r->data[1] = p->b[k];
+  r->data[2] = (double) p->count[k];
 
   /* We also store information about the worker */
   r->data[3] = (double) worker;
 
+  o = 4;
+  if (smoothing) {
+    r->data[4] = p->smooth[k];
+    r->data[5] = p->distance[k];
+    o = 6;
+  }
+  if (supersample) r->data[o] = p->aa[0];
+
   return MECHANIC_TASK_SUCCESS;
 }
 
 /**
  * An example of a custom function
  */
-int mandelbrot_generate_fractal(double a, double b, double c){
+int mandelbrot_generate_fractal(double a, double b, double c, int max_iter){
 
-  double temp, lengthsq;
-  int max_iter = 256;
-  int count = 0;
-  double zr = 0.0, zi = 0.0;
+  int count;
 
-  do {
+  mandelbrot_generate_fractalv(1, &a, &b, c, max_iter, &count);
 
-    temp = zr*zr - zi*zi + a;
-    zi = 2*zr*zi + b;
-    zr = temp;
-    lengthsq = zr*zr + zi*zi;
-    count++;
+  return count;
+}
 
-  } while ((lengthsq < c) && (count < max_iter));
+/**
+ * The smooth iteration counts and the exterior distance estimates of nl points
+ * from their count, the last orbit value z and its derivative dz/dc:
+ *
+ *   smooth = count - log2(log|z|^2 / log c),
+ *   distance = |z| log|z| / |dz|,
+ *
+ * where c is the bailout (c > 1). The smooth count is continuous across the
+ * bands of the integer count (the larger the bailout, the smoother), and the
+ * distance estimates the distance of the point to the set. The points which
+ * did not escape get max_iter and zero distance.
+ */
+static void mandelbrot_smooth(int nl, const double *cnt, const double *zr,
+    const double *zi, const double *dzr, const double *dzi, double c, double limit,
+    double *smooth, double *distance){
 
-  return count;
+  double lengthsq, dlengthsq;
+  int l;
+
+  for (l = 0; l < nl; l++) {
+    lengthsq = zr[l]*zr[l] + zi[l]*zi[l];
+    dlengthsq = dzr[l]*dzr[l] + dzi[l]*dzi[l];
+    if (lengthsq >= c && dlengthsq > 0.0) {
+      smooth[l] = cnt[l] - log2(log(lengthsq)/log(c));
+      distance[l] = 0.5*sqrt(lengthsq/dlengthsq)*log(lengthsq);
+    } else {
+      smooth[l] = limit;
+      distance[l] = 0.0;
+    }
+  }
 }
 
+/**
+ * The escape-time kernel of mandelbrot_generate_fractalv(), with track = 1 it
+ * also iterates the derivative dz/dc of the orbit for mandelbrot_smooth()
+ */
+static inline void mandelbrot_escape(int n, const double *a, const double *b, double c,
+    int max_iter, int *count, int track, double *smooth, double *distance){
+
+  double zr[MANDELBROT_LANES], zi[MANDELBROT_LANES];
+  double sr[MANDELBROT_LANES], si[MANDELBROT_LANES];
+  double cr[MANDELBROT_LANES], ci[MANDELBROT_LANES];
+  double cnt[MANDELBROT_LANES], alive[MANDELBROT_LANES];
+  double dzr[MANDELBROT_LANES], dzi[MANDELBROT_LANES];
+  double temp, tempi, dtemp, dtempi, lengthsq, active, q, limit;
+  long int iter;
+  int k, l, nl, it;
+
+  limit = (double) max_iter;
+
+  for (k = 0; k < n; k += MANDELBROT_LANES) {
+
+    nl = (n - k < MANDELBROT_LANES) ? n - k : MANDELBROT_LANES;
+
+    for (l = 0; l < nl; l++) {
+      cr[l] = a[k+l];
+      ci[l] = b[k+l];
+      zr[l] = 0.0;
+      zi[l] = 0.0;
+      dzr[l] = 0.0;
+      dzi[l] = 0.0;
+      sr[l] = 0.0;
+      si[l] = 0.0;
+      cnt[l] = 0.0;
+      alive[l] = 1.0;
+
+      /* The main cardioid and the period-2 bulb */
+      if (c >= 4.0) {
+        q = (cr[l] - 0.25)*(cr[l] - 0.25) + ci[l]*ci[l];
+        if (q*(q + cr[l] - 0.25) <= 0.25*ci[l]*ci[l]
+            || (cr[l] + 1.0)*(cr[l] + 1.0) + ci[l]*ci[l] <= 0.0625) {
+          cnt[l] = limit;
+          alive[l] = 0.0;
+        }
+      }
+    }
+
+    iter = 0;
+
+    do {
+
+      /* A few iterations between the checks, the escaped lanes stay frozen */
+      for (it = 0; it < 8; it++) {
+        for (l = 0; l < nl; l++) {
+          temp = zr[l]*zr[l] - zi[l]*zi[l] + cr[l];
+          tempi = 2*zr[l]*zi[l] + ci[l];
+          if (track) {
+            dtemp = 2*(zr[l]*dzr[l] - zi[l]*dzi[l]) + 1.0;
+            dtempi = 2*(zr[l]*dzi[l] + zi[l]*dzr[l]);
+            dzr[l] = (alive[l] > 0.0) ? dtemp : dzr[l];
+            dzi[l] = (alive[l] > 0.0) ? dtempi : dzi[l];
+          }
+          zi[l] = (alive[l] > 0.0) ? tempi : zi[l];
+          zr[l] = (alive[l] > 0.0) ? temp : zr[l];
+          lengthsq = zr[l]*zr[l] + zi[l]*zi[l];
+          cnt[l] = cnt[l] + alive[l];
+
+          /* The orbit is periodic, it never escapes */
+          cnt[l] = (alive[l] > 0.0 && zr[l] == sr[l] && zi[l] == si[l]) ? limit : cnt[l];
+
+          alive[l] = (lengthsq < c) ? alive[l] : 0.0;
+          alive[l] = (cnt[l] < limit) ? alive[l] : 0.0;
+        }
+
+        iter++;
+        if ((iter & (iter - 1)) == 0) {
+          for (l = 0; l < nl; l++) {
+            sr[l] = zr[l];
+            si[l] = zi[l];
+          }
+        }
+      }
+
+      active = 0.0;
+      for (l = 0; l < nl; l++) active = (alive[l] > active) ? alive[l] : active;
+
+    } while (active > 0.0);
+
+    for (l = 0; l < nl; l++) count[k+l] = (int) cnt[l];
+    if (track) mandelbrot_smooth(nl, cnt, zr, zi, dzr, dzi, c, limit, smooth + k, distance + k);
+  }
+}
+
+/**
+ * The batched escape-time kernel: the iteration counts of n points (a[k], b[k]).
+ *
+ * The points are iterated in blocks of MANDELBROT_LANES. Each lane is masked off
+ * once its point escapes, and the block ends when all of its points escaped or
+ * reached max_iter (checked every 8 iterations). The loops over the lanes have
+ * no data-dependent exits, so they map onto SIMD registers (compile with
+ * -O3 -march=native).
+ *
+ * The interior points finish early with max_iter, as they would after the full
+ * iteration: the points of the main cardioid and the period-2 bulb are found
+ * analytically (for the bailout c >= 4), the others when their orbit returns
+ * exactly to the value saved at the last power-of-two iteration (Brent)
+ */
+void mandelbrot_generate_fractalv(int n, const double *a, const double *b, double c,
+    int max_iter, int *count){
+
+  mandelbrot_escape(n, a, b, c, max_iter, count, 0, NULL, NULL);
+}
+
+/**
+ * The batched escape-time kernel with the smooth iteration counts and the
+ * exterior distance estimates, see mandelbrot_smooth()
+ */
+void mandelbrot_generate_smoothv(int n, const double *a, const double *b, double c,
+    int max_iter, int *count, double *smooth, double *distance){
+
+  mandelbrot_escape(n, a, b, c, max_iter, count, 1, smooth, distance);
+}
+
+/**
+ * The perturbation kernel of mandelbrot_perturbationv(), with track = 1 it also
+ * iterates the derivative dz/dc of the orbit for mandelbrot_smooth()
+ */
+static inline void mandelbrot_perturbation(int n, const double *da, const double *db,
+    const double *zr_ref, const double *zi_ref, int nref, double c, int max_iter,
+    int *count, int track, double *smooth, double *distance){
+
+  double dr[MANDELBROT_LANES], di[MANDELBROT_LANES];
+  double cr[MANDELBROT_LANES], ci[MANDELBROT_LANES];
+  double cnt[MANDELBROT_LANES], alive[MANDELBROT_LANES];
+  double dzr[MANDELBROT_LANES], dzi[MANDELBROT_LANES];
+  double fzr[MANDELBROT_LANES], fzi[MANDELBROT_LANES];
+  long int m[MANDELBROT_LANES];
+  double Zr, Zi, temp, tempi, dtemp, dtempi, zr, zi, lengthsq, deltasq, active, limit;
+  long int mn, rebase;
+  int k, l, nl, it;
+
+  limit = (double) max_iter;
+
+  for (k = 0; k < n; k += MANDELBROT_LANES) {
+
+    nl = (n - k < MANDELBROT_LANES) ? n - k : MANDELBROT_LANES;
+
+    for (l = 0; l < nl; l++) {
+      cr[l] = da[k+l];
+      ci[l] = db[k+l];
+      dr[l] = 0.0;
+      di[l] = 0.0;
+      dzr[l] = 0.0;
+      dzi[l] = 0.0;
+      m[l] = 0;
+      cnt[l] = 0.0;
+      alive[l] = 1.0;
+    }
+
+    do {
+
+      for (it = 0; it < 8; it++) {
+        for (l = 0; l < nl; l++) {
+          Zr = zr_ref[m[l]];
+          Zi = zi_ref[m[l]];
+          temp = 2*(Zr*dr[l] - Zi*di[l]) + dr[l]*dr[l] - di[l]*di[l] + cr[l];
+          tempi = 2*(Zr*di[l] + Zi*dr[l]) + 2*dr[l]*di[l] + ci[l];
+          if (track) {
+            zr = Zr + dr[l];
+            zi = Zi + di[l];
+            dtemp = 2*(zr*dzr[l] - zi*dzi[l]) + 1.0;
+            dtempi = 2*(zr*dzi[l] + zi*dzr[l]);
+            dzr[l] = (alive[l] > 0.0) ? dtemp : dzr[l];
+            dzi[l] = (alive[l] > 0.0) ? dtempi : dzi[l];
+          }
+
+          mn = m[l] + 1;
+          zr = zr_ref[mn] + temp;
+          zi = zi_ref[mn] + tempi;
+          lengthsq = zr*zr + zi*zi;
+          deltasq = temp*temp + tempi*tempi;
+
+          /* Rebase onto the start of the reference orbit */
+          rebase = (lengthsq < deltasq) | (mn == nref - 1);
+          temp = rebase ? zr : temp;
+          tempi = rebase ? zi : tempi;
+          mn = rebase ? 0 : mn;
+
+          dr[l] = (alive[l] > 0.0) ? temp : dr[l];
+          di[l] = (alive[l] > 0.0) ? tempi : di[l];
+          m[l] = (alive[l] > 0.0) ? mn : m[l];
+          cnt[l] = cnt[l] + alive[l];
+
+          alive[l] = (lengthsq < c) ? alive[l] : 0.0;
+          alive[l] = (cnt[l] < limit) ? alive[l] : 0.0;
+        }
+      }
+
+      active = 0.0;
+      for (l = 0; l < nl; l++) active = (alive[l] > active) ? alive[l] : active;
+
+    } while (active > 0.0);
+
+    for (l = 0; l < nl; l++) count[k+l] = (int) cnt[l];
+    if (track) {
+      for (l = 0; l < nl; l++) {
+        fzr[l] = zr_ref[m[l]] + dr[l];
+        fzi[l] = zi_ref[m[l]] + di[l];
+      }
+      mandelbrot_smooth(nl, cnt, fzr, fzi, dzr, dzi, c, limit, smooth + k, distance + k);
+    }
+  }
+}
+
+/**
+ * The batched perturbation kernel: the iteration counts of n points given by
+ * their offsets (da[k], db[k]) from the reference point, whose orbit is
+ * (zr_ref[m], zi_ref[m]), m = 0 ... nref-1, zr_ref[0] = zi_ref[0] = 0.
+ *
+ * Only the delta of the orbit is iterated in doubles:
+ *
+ *   d(n+1) = 2 Z(m) d(n) + d(n)^2 + dc,   z(n+1) = Z(m+1) + d(n+1),
+ *
+ * so the cost does not depend on the zoom depth. When the orbit gets closer to
+ * zero than its delta, or the reference orbit ends, the delta is rebased onto
+ * the start of the reference orbit (d = z, m = 0), which removes the glitches
+ * of the pixels whose orbit departs from the reference one.
+ *
+ * The lanes are masked as in mandelbrot_generate_fractalv(). The interior tests
+ * need the absolute coordinates, so all points iterate until they escape or
+ * reach max_iter.
+ */
+void mandelbrot_perturbationv(int n, const double *da, const double *db,
+    const double *zr_ref, const double *zi_ref, int nref, double c, int max_iter,
+    int *count){
+
+  mandelbrot_perturbation(n, da, db, zr_ref, zi_ref, nref, c, max_iter, count, 0, NULL,
+      NULL);
+}
+
+/**
+ * The batched perturbation kernel with the smooth iteration counts and the
+ * exterior distance estimates, see mandelbrot_smooth()
+ */
+void mandelbrot_perturbation_smoothv(int n, const double *da, const double *db,
+    const double *zr_ref, const double *zi_ref, int nref, double c, int max_iter,
+    int *count, double *smooth, double *distance){
+
+  mandelbrot_perturbation(n, da, db, zr_ref, zi_ref, nref, c, max_iter, count, 1, smooth,
+      distance);
+}
@@ -8,7 +8,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-int mandelbrot_generate_fractal(double a, double b, double c);
+/**
+ * The number of points iterated together by the batched kernel: four AVX-512
+ * registers of doubles, so that the independent iterations hide the latency
+ * of the multiplications
+ */
+#define MANDELBROT_LANES 32
+
+int mandelbrot_generate_fractal(double a, double b, double c, int max_iter);
+void mandelbrot_generate_fractalv(int n, const double *a, const double *b, double c,
+    int max_iter, int *count);
+void mandelbrot_generate_smoothv(int n, const double *a, const double *b, double c,
+    int max_iter, int *count, double *smooth, double *distance);
+void mandelbrot_perturbationv(int n, const double *da, const double *db,
+    const double *zr_ref, const double *zi_ref, int nref, double c, int max_iter,
+    int *count);
+void mandelbrot_perturbation_smoothv(int n, const double *da, const double *db,
+    const double *zr_ref, const double *zi_ref, int nref, double c, int max_iter,
+    int *count, double *smooth, double *distance);
 
 #endif
 
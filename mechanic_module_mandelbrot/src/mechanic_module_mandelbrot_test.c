@@ -0,0 +1,155 @@
+/**
+ * @file
+ * The check of the adaptive supersampling of the Mandelbrot module
+ */
+
+/**
+ * @section mandelbrot_test The supersampling check
+ *
+ * Renders the tiled image with the smooth counts, the supersampling and
+ * a bailout below 4, at which the smooth counts of the fast escaping pixels
+ * are negative. Each antialiased value is compared with the one recomputed
+ * pixel by pixel: the smooth count of an unmarked pixel, the mean of the SxS
+ * subsamples of a marked one.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mechanic_module_mandelbrot.c"
+
+#define TEST_TILE 8
+#define TEST_AA 2
+#define TEST_XRES 4
+#define TEST_YRES 4
+#define TEST_BAILOUT 2.0
+
+/**
+ * The smooth count of the pixel (x, y) of the nx x ny image, shifted by the
+ * offset (u, v) in the pixel units
+ */
+static double test_smooth(mandelbrot_params *p, int nx, int ny, int x, int y,
+    double u, double v, int *count){
+
+  double scale_real, scale_imag, da, db, a, b, smooth, distance;
+
+  scale_real = p->width / ((double) nx - 1.0);
+  scale_imag = p->height / ((double) ny - 1.0);
+
+  da = (x - 0.5*(nx - 1)) * scale_real;
+  db = (0.5*(ny - 1) - y) * scale_imag;
+  da = da + u * scale_real;
+  db = db - v * scale_imag;
+  a = (p->center_re + p->offset_re) + da;
+  b = (p->center_im + p->offset_im) + db;
+
+  mandelbrot_generate_smoothv(1, &a, &b, p->bailout, p->max_iter, count, &smooth,
+      &distance);
+
+  return smooth;
+}
+
+int main(void){
+
+  TaskInfo md;
+  TaskConfig d;
+  TaskData r;
+  mandelbrot_params *p;
+  int nx, ny, x, y, x0, y0, i, j, si, sj, s, t, o, flagged, marked, negative;
+  int c, cn, failed, mstat;
+  double expected, value, smooth;
+
+  setenv("MANDELBROT_TILE", "8", 1);
+  setenv("MANDELBROT_SMOOTH", "1", 1);
+  setenv("MANDELBROT_AA", "2", 1);
+
+  memset(&md, 0, sizeof(md));
+  memset(&d, 0, sizeof(d));
+  memset(&r, 0, sizeof(r));
+  d.xres = TEST_XRES;
+  d.yres = TEST_YRES;
+
+  mandelbrot_init(1, 0, &md, &d);
+  p = mandelbrot_parameters(&md, &d, &mstat);
+  if (p == NULL) {
+    fprintf(stderr, "Could not allocate the module parameters\n");
+    return EXIT_FAILURE;
+  }
+  p->bailout = TEST_BAILOUT;
+
+  r.data = calloc(md.output_length, sizeof(double));
+  if (r.data == NULL) return EXIT_FAILURE;
+
+  nx = TEST_TILE*TEST_XRES;
+  ny = TEST_TILE*TEST_YRES;
+  s = TEST_AA;
+  o = 3 + 3*TEST_TILE*TEST_TILE;
+  failed = 0;
+  marked = 0;
+  negative = 0;
+
+  for (t = 0; t < TEST_XRES*TEST_YRES; t++) {
+    r.coords[0] = t / TEST_YRES;
+    r.coords[1] = t % TEST_YRES;
+    mandelbrot_task_process(0, &md, &d, NULL, &r);
+
+    x0 = (int) r.data[0];
+    y0 = (int) r.data[1];
+
+    for (j = 0; j < TEST_TILE; j++) {
+      for (i = 0; i < TEST_TILE; i++) {
+        x = x0 + i;
+        y = y0 + j;
+
+        smooth = test_smooth(p, nx, ny, x, y, 0.0, 0.0, &c);
+        flagged = 0;
+        test_smooth(p, nx, ny, x - 1, y, 0.0, 0.0, &cn);
+        flagged |= (abs(c - cn) > p->aa_threshold);
+        test_smooth(p, nx, ny, x + 1, y, 0.0, 0.0, &cn);
+        flagged |= (abs(c - cn) > p->aa_threshold);
+        test_smooth(p, nx, ny, x, y - 1, 0.0, 0.0, &cn);
+        flagged |= (abs(c - cn) > p->aa_threshold);
+        test_smooth(p, nx, ny, x, y + 1, 0.0, 0.0, &cn);
+        flagged |= (abs(c - cn) > p->aa_threshold);
+
+        expected = smooth;
+        if (flagged) {
+          expected = 0.0;
+          for (sj = 0; sj < s; sj++) {
+            for (si = 0; si < s; si++) {
+              expected += test_smooth(p, nx, ny, x, y, (si + 0.5)/s - 0.5,
+                  (sj + 0.5)/s - 0.5, &cn);
+            }
+          }
+          expected = expected/(s*s);
+          marked++;
+        } else if (smooth < 0.0) {
+          negative++;
+        }
+
+        value = r.data[o + j*TEST_TILE + i];
+        if (value != expected) {
+          if (failed < 10) {
+            fprintf(stderr, "Pixel (%d, %d): %.17g, expected %.17g\n", x, y, value,
+                expected);
+          }
+          failed++;
+        }
+      }
+    }
+  }
+
+  free(r.data);
+  mandelbrot_cleanup(1, 0, &md, &d);
+
+  printf("%d pixels, %d marked, %d unmarked with the negative smooth count, %d failed\n",
+      nx*ny, marked, negative, failed);
+
+  /* The check must cover both kinds of pixels */
+  if (marked == 0 || negative == 0) return EXIT_FAILURE;
+
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}